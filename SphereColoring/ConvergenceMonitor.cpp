@@ -0,0 +1,58 @@
+#include "ConvergenceMonitor.h"
+#include <cmath>
+
+using namespace std;
+
+void ConvergenceMonitor::reset()
+{
+   _Status = RUNNING;
+   _NumSteps = 0;
+   _NumWindows = 0;
+   _WindowsSinceImprovement = 0;
+   _BestError = -1;
+   _LastError = -1;
+   _LastPaddingError = -1;
+}
+
+ConvergenceMonitor::Status ConvergenceMonitor::addWindow( double error, double paddingError, int numSteps )
+{
+   if ( _Status != RUNNING )
+      return _Status;
+
+   _NumSteps += numSteps;
+   _NumWindows++;
+   _LastError = error;
+   _LastPaddingError = paddingError;
+
+   double watched = _WatchPadding ? paddingError : error;
+   if ( !isfinite( error ) || !isfinite( paddingError ) )
+      _Status = DIVERGED;
+   else if ( watched <= _Tolerance )
+      _Status = CONVERGED;
+   else
+   {
+      if ( _BestError < 0 || watched < _BestError * (1 - _MinImprovement) )
+      {
+         _BestError = watched;
+         _WindowsSinceImprovement = 0;
+      }
+      else if ( ++_WindowsSinceImprovement >= _StallWindows )
+         _Status = STALLED;
+   }
+
+   if ( _Status != RUNNING && _OnFinished )
+      _OnFinished( _Status );
+   return _Status;
+}
+
+const char* ConvergenceMonitor::nameOf( Status status )
+{
+   switch ( status )
+   {
+   case RUNNING:   return "running";
+   case CONVERGED: return "converged";
+   case STALLED:   return "stalled";
+   case DIVERGED:  return "diverged";
+   }
+   return "";
+}
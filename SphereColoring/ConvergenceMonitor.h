@@ -0,0 +1,36 @@
+#pragma once
+
+#include <functional>
+
+// watches the average errors of consecutive batches of simulation steps (windows) and decides when a run is over:
+// - converged: the error is at most _Tolerance
+// - stalled: the best error hasn't improved by _MinImprovement (relative) for _StallWindows windows
+// - diverged: the error isn't finite
+// - with _WatchPadding the padding error is judged instead, it keeps improving after the error has reached 0
+class ConvergenceMonitor
+{
+public:
+   enum Status { RUNNING, CONVERGED, STALLED, DIVERGED };
+
+public:
+   void reset();
+   Status addWindow( double error, double paddingError, int numSteps ); // calls _OnFinished once the status leaves RUNNING
+   Status status() const { return _Status; }
+   bool isFinished() const { return _Status != RUNNING; }
+   static const char* nameOf( Status status );
+
+public:
+   double _Tolerance = 0;
+   int _StallWindows = 20;
+   double _MinImprovement = .01;
+   bool _WatchPadding = false;
+   std::function<void(Status)> _OnFinished;
+
+   Status _Status = RUNNING;
+   int _NumSteps = 0;                 // since the last reset
+   int _NumWindows = 0;
+   int _WindowsSinceImprovement = 0;
+   double _BestError = -1;            // -1 before the first window
+   double _LastError = -1;
+   double _LastPaddingError = -1;
+};
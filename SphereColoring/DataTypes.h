@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cmath>
+#include <vector>
 #include <QPoint>
 #include <QVector3D>
 
@@ -77,10 +78,37 @@ public:
    double x, y, z, w;
 };
 
+// orthonormal 3x3 matrix (columns m[0..2]), for the symmetry elements and the model rotation
+// - the inverse is the transpose, there's no w to divide by
+class Rotation3
+{
+public:
+   Rotation3() { m[0] = XYZ( 1, 0, 0 ); m[1] = XYZ( 0, 1, 0 ); m[2] = XYZ( 0, 0, 1 ); }
+   Rotation3( const XYZ& m0, const XYZ& m1, const XYZ& m2 ) { m[0] = m0; m[1] = m1; m[2] = m2; }
+   Rotation3( double m00, double m01, double m02, 
+              double m10, double m11, double m12, 
+              double m20, double m21, double m22 ) { m[0] = XYZ(m00,m10,m20); m[1] = XYZ(m01,m11,m21); m[2] = XYZ(m02,m12,m22); }
+   XYZ& operator[]( int idx ) { return m[idx]; }
+   const XYZ& operator[]( int idx ) const { return m[idx]; }
+   XYZ operator*( const XYZ& v ) const { return m[0] * v.x + m[1] * v.y + m[2] * v.z; }
+   Rotation3 operator*( const Rotation3& rhs ) const { return Rotation3( *this * rhs[0], *this * rhs[1], *this * rhs[2] ); }
+   static Rotation3 rotationX( double a ) { return Rotation3( { 1, 0, 0 }, { 0, cos(a), sin(a) }, { 0, -sin(a), cos(a) } ); }
+   static Rotation3 rotationY( double a ) { return Rotation3( { cos(a), 0, sin(a) }, { 0, 1, 0 }, { -sin(a), 0, cos(a) } ); }
+   static Rotation3 rotation( const XYZ& axis, double angle ) { XYZ u = axis.normalized(); double cs = cos(angle); double sn = sin(angle);    return Rotation3( { cs + u.x*u.x*(1-cs), u.y*u.x*(1-cs) + u.z*sn, u.z*u.x*(1-cs) - u.y*sn }, { u.x*u.y*(1-cs) - u.z*sn, cs + u.y*u.y*(1-cs), u.z*u.y*(1-cs) + u.x*sn }, { u.x*u.z*(1-cs) + u.y*sn, u.y*u.z*(1-cs) - u.x*sn, cs + u.z*u.z*(1-cs) } ); }
+
+   double operator()( int r, int c ) const { return r == 0 ? m[c].x : r == 1 ? m[c].y : m[c].z; }
+   Rotation3 transposed() const { return Rotation3( m[0].x, m[0].y, m[0].z, m[1].x, m[1].y, m[1].z, m[2].x, m[2].y, m[2].z ); }
+   Rotation3 inverted() const { return transposed(); }
+
+public:
+   XYZ m[3];
+};
+
 class Matrix4x4
 {
 public:
    Matrix4x4() { m[0] = XYZW( 1, 0, 0, 0 ); m[1] = XYZW( 0, 1, 0, 0 ); m[2] = XYZW( 0, 0, 1, 0 ); m[3] = XYZW( 0, 0, 0, 1 ); }
+   explicit Matrix4x4( const Rotation3& r ) { m[0] = XYZW( r[0].x, r[0].y, r[0].z, 0 ); m[1] = XYZW( r[1].x, r[1].y, r[1].z, 0 ); m[2] = XYZW( r[2].x, r[2].y, r[2].z, 0 ); m[3] = XYZW( 0, 0, 0, 1 ); }
    Matrix4x4( const XYZW& m0, const XYZW& m1, const XYZW& m2, const XYZW& m3 ) { m[0] = m0; m[1] = m1; m[2] = m2; m[3] = m3; }
    Matrix4x4( double m00, double m01, double m02, double m03, 
               double m10, double m11, double m12, double m13, 
@@ -112,3 +140,40 @@ public:
 public:
    XYZW m[4];
 };
+
+// read-only view of a contiguous range of T
+template<class T> class Span
+{
+public:
+   Span( const T* begin, const T* end ) : _Begin(begin), _End(end) {}
+   const T* begin() const { return _Begin; }
+   const T* end() const { return _End; }
+   int size() const { return (int) (_End - _Begin); }
+   bool empty() const { return _Begin == _End; }
+   const T& operator[]( int idx ) const { return _Begin[idx]; }
+
+private:
+   const T* _Begin;
+   const T* _End;
+};
+
+// compressed sparse rows: row i is _Items[_Offsets[i].._Offsets[i+1]), all rows share one allocation
+template<class T> class Csr
+{
+public:
+   Csr() : _Offsets( 1, 0 ) {}
+   Csr( const std::vector<std::vector<T>>& rows ) : _Offsets( 1, 0 )
+   {
+      for ( const std::vector<T>& row : rows )
+         _Offsets.push_back( _Offsets.back() + (int) row.size() );
+      _Items.reserve( _Offsets.back() );
+      for ( const std::vector<T>& row : rows )
+         _Items.insert( _Items.end(), row.begin(), row.end() );
+   }
+   int size() const { return (int) _Offsets.size() - 1; }
+   Span<T> operator[]( int row ) const { return Span<T>( _Items.data() + _Offsets[row], _Items.data() + _Offsets[row+1] ); }
+
+public:
+   std::vector<int> _Offsets;
+   std::vector<T> _Items;
+};
@@ -292,7 +292,7 @@ void Drawing::updateLabel()
 
 QMtx4x4 Drawing::modelToBitmap() const
 {
-   return modelToBitmapNoRot() * modelRotation();
+   return modelToBitmapNoRot() * QMtx4x4( modelRotation() );
 }
 
 QMtx4x4 Drawing::modelToBitmapNoRot() const
@@ -306,9 +306,9 @@ QMtx4x4 Drawing::modelToBitmapNoRot() const
    return ret;
 }
 
-QMtx4x4 Drawing::modelRotation() const
+Rotation3 Drawing::modelRotation() const
 {
-   QMtx4x4 ret;
+   Rotation3 ret;
    return _ModelRotation;
    //ret.rotateX( -_XRotation/60. );
    //ret.rotateY( _YRotation/60. );
@@ -372,10 +372,10 @@ QImage Drawing::makeImage( Graph& graph )
    {
       Graph::VertexPtr bestVtx;
       double bestDist = 9999;
-      for ( const ISymmetry::Config& config : GlobalSymmetry::matrices() )
+      for ( int elem = 0; elem < MatrixIndexMap::size(); elem++ )
       for ( const Graph::VertexPtr& a_ : graph.rawVertices() )
       {
-         Graph::VertexPtr a( a_._Index, config.m );
+         Graph::VertexPtr a( a_._Index, elem );
          if ( graph.posOf( a ).z >= 0 )
             continue;
          QPointF bitmapPos = ( modelToBitmap * graph.posOf( a ) ).toPointF();
@@ -395,7 +395,7 @@ QImage Drawing::makeImage( Graph& graph )
       XYZ p;
       bitmapToModel( clickedPos, p );
 
-      graph._Vertices[clickedVtx._Index]._Pos = clickedVtx._Mtx.inverted() * p;
+      graph._Vertices[clickedVtx._Index]._Pos = MatrixIndexMap::at( MatrixIndexMap::inverse( clickedVtx._Elem ) ) * p;
    }
 
    if ( clickedVtx.isValid() )
@@ -407,16 +407,17 @@ QImage Drawing::makeImage( Graph& graph )
 
 
    for ( int stage : { 1, 3, 4, 6, 7, 8, 9, 10, 11 } )
-      for ( const ISymmetry::Config& config : GlobalSymmetry::matrices() )
+      for ( int elem = 0; elem < MatrixIndexMap::size(); elem++ )
       {
-         const QMtx4x4& m = config.m;
+         const ISymmetry::Config& config = MatrixIndexMap::theInstance()._Matrices[elem];
+         const Rotation3& m = config.m;
 
-         auto toBitmap = [&]( const XYZ& pos ) { return ( modelToBitmap * m * pos ).toPointF(); };
+         auto toBitmap = [&]( const XYZ& pos ) { return ( modelToBitmap * (m * pos) ).toPointF(); };
          auto toBitmapNoRotate = [&]( const XYZ& pos ) { return pos.toPointF(); };
                   
          if ( stage == 1 && !_ShowDual )
          {
-            Perm quadPerm = GlobalSymmetry::colorPermOf( m );
+            const Perm& quadPerm = MatrixIndexMap::colorPerm( elem );
 
             int alpha = 255;
             if ( config.isHomeState() )
@@ -425,7 +426,7 @@ QImage Drawing::makeImage( Graph& graph )
             int idx = 0;
             for ( const Graph::TilePtr& tile_ : graph.rawTiles() )
             {
-               Graph::TilePtr tile = tile_.premul( m );
+               Graph::TilePtr tile = tile_.premul( elem );
 
                //{
                //   bool tileVisible = false;
@@ -500,11 +501,11 @@ QImage Drawing::makeImage( Graph& graph )
          {
             painter.setPen( QPen( QColor(0,0,0,96), 2.5 ) );
             painter.setBrush( Qt::NoBrush );
-            for ( const ISymmetry::Config& config : GlobalSymmetry::matrices() )
+            for ( int elem = 0; elem < MatrixIndexMap::size(); elem++ )
                for ( const auto& pr : _Simulation->_KeepCloseFars ) if ( pr.a.id() < pr.b.id() )
                {  
-                  XYZ a = graph.posOf( pr.a.premul( config.m ) );
-                  XYZ b = graph.posOf( pr.b.premul( config.m ) );
+                  XYZ a = graph.posOf( pr.a.premul( elem ) );
+                  XYZ b = graph.posOf( pr.b.premul( elem ) );
 
                   if ( _DrawCurves )
                   {
@@ -537,7 +538,7 @@ QImage Drawing::makeImage( Graph& graph )
             for ( const Graph::TilePtr& tile : graph.allTiles() ) if ( graph.colorOf( tile ) == lround(_Custom[0]) )
             //const Graph::Tile& tile = graph._Tiles[lround(_Custom[0])];
             {
-               if ( !graph._Tiles[tile._Index]._SymmetryMap->isReal( tile._Mtx ) ) // only use one copy
+               if ( !graph._Tiles[tile._Index]._SymmetryMap->isReal( tile._Elem ) ) // only use one copy
                   continue;
 
                vector<XYZ> outline = expandOutlineOnSphere( calcTileOutline( graph, tile, .02 ), .02 );
@@ -23,7 +23,7 @@ public:
    QPoint mousePos() const;
    QMtx4x4 modelToBitmap() const;
    QMtx4x4 modelToBitmapNoRot() const;
-   QMtx4x4 modelRotation() const;
+   Rotation3 modelRotation() const;
 
    bool bitmapToModel( const QPoint& p, XYZ& modelPos ) const;
    bool isOnNearSide( const XYZ& p ) const;
@@ -48,7 +48,7 @@ private:
    Ui::Drawing ui;
 
 public:
-   QMtx4x4 _ModelRotation;
+   Rotation3 _ModelRotation;
    double _Radius = 0;
    double _YRotation = 0;
    double _XRotation = 0;
@@ -0,0 +1,57 @@
+#include "DualIO.h"
+#include <QJsonDocument>
+#include <QJsonArray>
+#include <QJsonObject>
+#include <QFile>
+
+using namespace std;
+
+
+void saveDual( const QString& filename, const Dual& dual )
+{
+   if ( filename.isEmpty() )
+      return;
+   
+   QJsonArray vertices;
+   for ( const Dual::Vertex& a : dual._Vertices )
+      vertices.push_back( QJsonObject { { "color", a._Color }, { "x", a._Pos.x }, { "y", a._Pos.y }, { "z", a._Pos.z } } );
+
+   QJsonArray edges;
+   for ( const Dual::Vertex& a : dual._Vertices )
+      for ( const Dual::VertexPtr& b : a._Neighbors ) if ( a._Index <= b._Index )
+         edges.push_back( QJsonArray { a._Index, b._Index, b._Elem } );
+   QJsonObject graph = { { "vertices", vertices }, { "edges", edges }, { "symmetry", QString::fromStdString( dual._Group->_Symmetry->name() ) } };         
+   {
+      QFile f( filename );
+      f.open(QFile::WriteOnly);
+      f.write(QJsonDocument( graph ).toJson());            
+   }   
+}
+
+shared_ptr<Dual> loadDual( const QString& filename )
+{
+   if ( filename.isEmpty() )
+      return nullptr;
+
+   QFile f( filename );
+   f.open( QFile::ReadOnly );
+   QJsonDocument doc = QJsonDocument::fromJson( f.readAll() );
+
+   // the loaded symmetry becomes current in this thread, the dual keeps it as its context
+   GlobalSymmetry::setSymmetry( doc["symmetry"].toString().toStdString() );
+
+   shared_ptr<Dual> dual( new Dual );
+
+   for ( const QJsonValue& vertex_ : doc["vertices"].toArray() )
+   {
+      QJsonObject vertex = vertex_.toObject();
+      dual->addVertex( vertex["color"].toInt(), XYZ( vertex["x"].toDouble(), vertex["y"].toDouble(), vertex["z"].toDouble() ) );      
+      dual->_Vertices.back()._SymmetryMap = MatrixSymmetryMap::symmetryFor( dual->_Vertices.back()._Pos );
+   }
+   for ( const QJsonValue& edge_ : doc["edges"].toArray() )
+   {
+      QJsonArray edge = edge_.toArray();
+      dual->toggleEdge( Dual::VertexPtr( edge[0].toInt(), MatrixIndexMap::IDENTITY ), Dual::VertexPtr( edge[1].toInt(), edge[2].toInt() ), true/*only add edges*/ );
+   }
+   return dual;
+}
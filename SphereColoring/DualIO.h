@@ -0,0 +1,8 @@
+#pragma once
+
+#include "Model.h"
+#include <QString>
+#include <memory>
+
+void saveDual( const QString& filename, const Dual& dual );
+shared_ptr<Dual> loadDual( const QString& filename );
@@ -1,7 +1,11 @@
 #include "Model.h"
+#include "ThreadPool.h"
 
 #include <algorithm>
 #include <map>
+#include <set>
+#include <unordered_map>
+#include <atomic>
 
 
 bool isClockwiseTri( const QPolygonF& poly )
@@ -11,12 +15,17 @@ bool isClockwiseTri( const QPolygonF& poly )
    return u.x() * v.y() < u.y() * v.x();
 }
 
-QMtx4x4 toMatrix( const XYZ& a, const XYZ& b, const XYZ& c )
+Rotation3 toMatrix( const XYZ& a, const XYZ& b, const XYZ& c )
 {
-   return QMtx4x4( a.x, b.x, c.x, 0,
-                   a.y, b.y, c.y, 0, 
-                   a.z, b.z, c.z, 0, 
-                   0,   0,   0  , 1 );
+   return Rotation3( a, b, c );
+}
+
+// orthonormal frame with u as the first axis and v in the plane of the first two
+Rotation3 frameOf( const XYZ& u, const XYZ& v )
+{
+   XYZ a = u.normalized();
+   XYZ b = ( v - a * (v*a) ).normalized();
+   return toMatrix( a, b, a^b );
 }
 
 vector<int> canonicalRotation( vector<int> v )
@@ -31,58 +40,44 @@ vector<int> sorted( vector<int> v )
    return v;
 }
 
-uint32_t toBitFlag( const vector<int>& v )
+// rotation that maps the points a onto the congruent points b
+Rotation3 map( const vector<XYZ>& a, const vector<XYZ>& b )
 {
-   uint32_t ret = 0;
-   for ( int x : v )
-      ret |= 1u << x;
-   return ret;
-}
-
-QMtx4x4 translation( const XYZ& p ) { QMtx4x4 m; m.translate( p.x, p.y, p.z ); return m; }
-
-QMtx4x4 map( const vector<XYZ>& a, const vector<XYZ>& b )
-{
-   if ( a.size() == 3 && b.size() == 3 )
-      return toMatrix( b[0], b[1], b[2] ) * toMatrix( a[0], a[1], a[2] ).inverted();
-   if ( a.size() == 4 && b.size() == 4 )
-   {
-      QMtx4x4 m = ::map( { a[1]-a[0], a[2]-a[0], a[3]-a[0] }, { b[1]-b[0], b[2]-b[0], b[3]-b[0] } );
-      return translation( b[0] ) * m * translation( -a[0] );
-   }
-   throw 777;
+   if ( a.size() < 2 || a.size() != b.size() )
+      throw 777;
+   return frameOf( b[0], b[1] ) * frameOf( a[0], a[1] ).transposed();
 }
 
 // rotation matrix that rotates p to the Z-axis
-QMtx4x4 matrixRotateToZAxis( XYZ& p )
+Rotation3 matrixRotateToZAxis( const XYZ& p )
 {
    XYZ newZ = p.normalized();
    XYZ q = abs(newZ.z) < abs(newZ.y) ? XYZ(0,0,1) : XYZ(0,1,0);
    XYZ newX = (newZ ^ q).normalized();
    XYZ newY = (newZ ^ newX).normalized();
-   return QMtx4x4( toMatrix( newX, newY, newZ ) ).inverted();
+   return toMatrix( newX, newY, newZ ).transposed();
 }
 
-QMtx4x4 pow( const QMtx4x4& m, int power )
+Rotation3 pow( const Rotation3& m, int power )
 {
-   QMtx4x4 ret;
+   Rotation3 ret;
    for ( int i = 0; i < power; i++ )
       ret = ret * m;
    return ret;
 }
 
-bool fuzzyCompare( const QMtx4x4& a, const QMtx4x4& b )
+bool fuzzyCompare( const Rotation3& a, const Rotation3& b )
 {
-   for ( int y = 0; y < 4; y++ )
-      for ( int x = 0; x < 4; x++ )
+   for ( int y = 0; y < 3; y++ )
+      for ( int x = 0; x < 3; x++ )
          if ( abs( a(y,x) - b(y,x) ) >= 1e-5 )
             return false;
    return true;
 }
 
-bool isIdentity( const QMtx4x4& a )
+bool isIdentity( const Rotation3& a )
 {
-   return fuzzyCompare( a, QMtx4x4() );
+   return fuzzyCompare( a, Rotation3() );
 }
 
 bool contains( const vector<QPoint>& v, const QPoint& p )
@@ -92,7 +87,7 @@ bool contains( const vector<QPoint>& v, const QPoint& p )
 
 // [0..2^18)
 // [0..262144)
-uint64_t matrixId( const QMtx4x4& m )
+uint64_t matrixId( const Rotation3& m )
 {
    uint64_t ret = 0;
    ret = ret * 8 + ( int( m(0,0) / .24 ) + 3 );
@@ -104,6 +99,94 @@ uint64_t matrixId( const QMtx4x4& m )
    return ret;
 }
 
+GroupSymmetry::GroupSymmetry( const string& name, const vector<Generator>& generators, const vector<XYZ>& sectorOutline, const vector<XYZ>& symmetryPoints )
+   : _Name( name ), _SectorOutline( sectorOutline ), _SymmetryPoints( symmetryPoints )
+{
+   _Configs.push_back( Config { Rotation3(), {0}, Perm( BLANK_COLOR+1 ) } );
+   _MatrixIdToConfigIndex[matrixId( _Configs[0].m )] = 0;
+
+   // breadth first: every new element is a known element times a generator
+   for ( int i = 0; i < (int) _Configs.size(); i++ )
+      for ( const Generator& g : generators )
+      {
+         Config config { _Configs[i].m * g.m, { (int) _Configs.size() }, g.colorPerm * _Configs[i].colorPerm };
+         uint64_t id = matrixId( config.m );
+         if ( !_MatrixIdToConfigIndex.count( id ) )
+         {
+            _MatrixIdToConfigIndex[id] = (int) _Configs.size();
+            _Configs.push_back( config );
+         }
+         else if ( !fuzzyCompare( _Configs[_MatrixIdToConfigIndex[id]].m, config.m ) || _Configs[_MatrixIdToConfigIndex[id]].colorPerm.v != config.colorPerm.v )
+            throw 777; // either the matrix ids collide or the color permutations don't respect the group
+      }
+}
+
+// color i is the i-th axis, the permutation follows where m takes the axes
+static Perm axisPermOf( const Rotation3& m, const vector<XYZ>& axes )
+{
+   Perm ret( BLANK_COLOR+1 );
+   for ( int i = 0; i < (int) axes.size(); i++ )
+      for ( int j = 0; j < (int) axes.size(); j++ )
+         if ( abs( ( m * axes[i] ).normalized() * axes[j].normalized() ) > 1-1e-9 )
+            ret.v[i] = j;
+   return ret;
+}
+
+shared_ptr<GroupSymmetry> GroupSymmetry::cyclic( int n, const Perm& colorPerm )
+{
+   const double PI = acos(0.) * 2.;
+   return make_shared<GroupSymmetry>( "rot" + to_string( n ), vector<Generator> { { Rotation3::rotationY( 2*PI/n ), Perm( BLANK_COLOR+1 ) * colorPerm } },
+                                      vector<XYZ> { XYZ(0,1,0), XYZ(0,0,1), XYZ(0,-1,0), XYZ(0,0,1) }, vector<XYZ> { XYZ(0,1,0), XYZ(0,-1,0) } );
+}
+
+shared_ptr<GroupSymmetry> GroupSymmetry::dihedral( int n )
+{
+   const double PI = acos(0.) * 2.;
+   Rotation3 rot = Rotation3::rotationY( 2*PI/n );
+   XYZ x( 1, 0, 0 );
+   return make_shared<GroupSymmetry>( "dih" + to_string( n ), vector<Generator> { { rot, Perm( BLANK_COLOR+1 ) }, { Rotation3::rotationX( PI ), Perm( BLANK_COLOR+1 ) } },
+                                      vector<XYZ> { XYZ(0,1,0), x, rot * x }, vector<XYZ> { XYZ(0,1,0), x, Rotation3::rotationY( PI/n ) * x } );
+}
+
+// colors 0-2 follow the coordinate axes
+shared_ptr<GroupSymmetry> GroupSymmetry::tetrahedral()
+{
+   const double PI = acos(0.) * 2.;
+   vector<XYZ> axes = { XYZ(1,0,0), XYZ(0,1,0), XYZ(0,0,1) };
+   Rotation3 rot3 = Rotation3::rotation( XYZ(1,1,1), 2*PI/3 );
+   Rotation3 rot2 = Rotation3::rotation( XYZ(0,0,1), PI );
+   XYZ v0( 1, 1, 1 ), v1( 1, -1, -1 ), v2( -1, 1, -1 );
+   return make_shared<GroupSymmetry>( "tetra12", vector<Generator> { { rot3, axisPermOf( rot3, axes ) }, { rot2, axisPermOf( rot2, axes ) } },
+                                      vector<XYZ> { v0, v0+v1, v0+v1+v2, v0+v2 }, vector<XYZ> { v0, v0+v1, v0+v1+v2 } );
+}
+
+// colors 0-2 follow the coordinate axes
+shared_ptr<GroupSymmetry> GroupSymmetry::octahedral()
+{
+   const double PI = acos(0.) * 2.;
+   vector<XYZ> axes = { XYZ(1,0,0), XYZ(0,1,0), XYZ(0,0,1) };
+   Rotation3 rot3 = Rotation3::rotation( XYZ(1,1,1), 2*PI/3 );
+   Rotation3 rot4 = Rotation3::rotationY( PI/2 );
+   XYZ v0( 0, 1, 0 ), v1( 1, 0, 0 ), v2( 0, 0, 1 );
+   return make_shared<GroupSymmetry>( "octa24", vector<Generator> { { rot3, axisPermOf( rot3, axes ) }, { rot4, axisPermOf( rot4, axes ) } },
+                                      vector<XYZ> { v0, v0+v1, v0+v1+v2, v0+v2 }, vector<XYZ> { v0, v0+v1, v0+v1+v2 } );
+}
+
+shared_ptr<GroupSymmetry> GroupSymmetry::fromName( const string& name )
+{
+   if ( name == "rot3" ) return cyclic( 3, Perm( {1,2,0,4,5,3,6} ) );
+   if ( name == "rot5" ) return cyclic( 5, Perm( {1,2,3,4,0,5,6} ) );
+   if ( name == "tetra12" ) return tetrahedral();
+   if ( name == "octa24" ) return octahedral();
+
+   int n = 0;
+   if ( name.compare( 0, 3, "rot" ) == 0 ) n = atoi( name.c_str() + 3 );
+   if ( name.compare( 0, 3, "dih" ) == 0 ) n = atoi( name.c_str() + 3 );
+   if ( n < 2 || n > MAX_N )
+      return nullptr;
+   return name[0] == 'r' ? cyclic( n ) : dihedral( n );
+}
+
 
 
 
@@ -133,6 +216,30 @@ namespace
 }
 
 
+// runs body( i ) for every i in [0,n), spread over the pool
+// - the workers make group current, progress is reported from the calling thread
+static void parallelFor( int n, ThreadPool* pool, const shared_ptr<MatrixIndexMap>& group, const char* stage, const ProgressCallback& progress, const function<void(int)>& body )
+{
+   atomic<int> next( 0 );
+   atomic<int> numDone( 0 );
+   auto task = [&]( int threadIdx ) {
+      SymmetryScope scope( group );
+      for ( int i = next++; i < n; i = next++ )
+      {
+         body( i );
+         numDone++;
+         if ( threadIdx == 0 && progress )
+            progress( stage, numDone, n );
+      }
+   };
+   if ( pool )
+      pool->run( task );
+   else
+      task( 0 );
+   if ( progress )
+      progress( stage, n, n );
+}
+
 Graph::Graph()
 {
 }
@@ -147,95 +254,132 @@ XYZ avg( const vector<XYZ>& pts )
 
 XYZ Graph::posOf( const VertexPtr& vtx ) const
 {
-   return vtx._Mtx * _Vertices[vtx._Index]._Pos;
+   Q_ASSERT( isCurrent() );
+   return vtx.mtx() * _Vertices[vtx._Index]._Pos;
 }
 
 int Graph::idOf( const VertexPtr& vtx ) const
 {
-   return MatrixIndexMap::indexOf( vtx._Mtx ) * _Vertices.size() + vtx._Index;
+   return vtx._Elem * (int) _Vertices.size() + vtx._Index;
 }
 
 Graph::VertexPtr Graph::fromId( int id ) const
 {
    int sz = (int) _Vertices.size();   
-   return VertexPtr( id % sz, MatrixIndexMap::at( id / sz ) );
-}
-
-uint64_t Graph::VertexPtr::id() const
-{
-   return _Index * (1LL<<18) + matrixId( _Mtx );
-}
-
-void Graph::addNeighbor( const VertexPtr& a, const VertexPtr& b )
-{
-   VertexPtr bb = b.premul( a._Mtx.inverted() );
-
-   if ( a == b )
-      qDebug( "addNeighbor dup" );
-   
-   for ( const VertexPtr& v : _Vertices[a._Index]._Neighbors )
-      if ( bb == v )
-         return; // already have it
-
-   _Vertices[a._Index]._Neighbors.push_back( bb );
+   return VertexPtr( id % sz, id / sz );
 }
 
 vector<Graph::VertexPtr> Graph::neighbors( const VertexPtr& vtx ) const
 {
+   Q_ASSERT( isCurrent() );
    vector<Graph::VertexPtr> ret;
    
-   for ( const Graph::VertexPtr& neighb : _Vertices[vtx._Index]._Neighbors )
-      ret.push_back( neighb.premul( vtx._Mtx ) );
+   for ( const Graph::VertexPtr& neighb : _Neighbors[vtx._Index] )
+      ret.push_back( neighb.premul( vtx._Elem ) );
 
    return ret;
 }
 
 vector<Graph::VertexPtr> Graph::neighbors( const VertexPtr& vtx, int depth ) const
 {
-   unordered_set<uint64_t> st;
+   Q_ASSERT( isCurrent() );
    vector<Graph::VertexPtr> ret;
-
-   neighbors( vtx, depth, ret, st );
-   ret.erase( ret.begin() );
-
+   for ( const Graph::VertexPtr& neighb : neighborhood( vtx._Index, depth ) )
+      ret.push_back( neighb.premul( vtx._Elem ) );
    return ret;
 }
 
-void Graph::neighbors( const VertexPtr& vtx, int depth, vector<Graph::VertexPtr>& v, unordered_set<uint64_t>& st ) const
+// the vertices at most depth edges away from vertex index (without itself), relative to its identity copy
+Span<Graph::VertexPtr> Graph::neighborhood( int index, int depth ) const
 {
-   uint64_t id = vtx.id();
-   if ( !st.count( id ) )
+   lock_guard<mutex> lock( _NeighborhoodsMutex ); // the rows stay where they are once built, only the map needs the lock
+   auto it = _Neighborhoods.find( depth );
+   if ( it == _Neighborhoods.end() )
    {
-      st.insert( id );
-      v.push_back( vtx );
+      SymmetryScope scope( _Group ); // the cache outlives the caller's context
+      it = _Neighborhoods.emplace( depth, calcNeighborhoods( depth ) ).first;
    }
+   return it->second[index];
+}
 
-   if ( depth <= 0 )
-      return;
-
-   vector<Graph::VertexPtr> ret;
+// depth first from every vertex, in the order the constraints have always been generated in
+// - a vertex is not expanded again if an expansion of it with at least as much depth left has finished, that one already visited everything
+// - the marks hold the index of the start vertex so they never need clearing
+Csr<Graph::VertexPtr> Graph::calcNeighborhoods( int depth ) const
+{
+   int numVertices = (int) _Vertices.size();
+   int n = numVertices * MatrixIndexMap::size();
+   vector<int> visitedBy( n, -1 );
+   vector<int> expandedBy( n, -1 );
+   vector<int> expandedDepth( n );
+   vector<vector<VertexPtr>> rows( numVertices );
+   struct Frame
+   {
+      VertexPtr vtx;
+      int depth;
+      int next; // the next neighbor to visit
+   };
+   vector<Frame> stack;
+   for ( int i = 0; i < numVertices; i++ )
+   {
+      vector<VertexPtr>& row = rows[i];
+      // adds vtx to the row on its first visit, true if it still needs expanding
+      auto enter = [&]( const VertexPtr& vtx, int d ) {
+         int id = idOf( vtx );
+         if ( visitedBy[id] != i )
+         {
+            visitedBy[id] = i;
+            row.push_back( vtx );
+         }
+         return d > 0 && !( expandedBy[id] == i && expandedDepth[id] >= d );
+      };
 
-   for ( const Graph::VertexPtr& neighb : _Vertices[vtx._Index]._Neighbors )
-      neighbors( neighb.premul( vtx._Mtx ), depth-1, v, st );
+      VertexPtr start( i, MatrixIndexMap::IDENTITY );
+      if ( enter( start, depth ) )
+         stack.push_back( { start, depth, 0 } );
+      while ( !stack.empty() )
+      {
+         Frame& f = stack.back();
+         Span<VertexPtr> neighbors = _Neighbors[f.vtx._Index];
+         if ( f.next < neighbors.size() )
+         {
+            VertexPtr neighb = neighbors[f.next++].premul( f.vtx._Elem );
+            int d = f.depth-1;
+            if ( enter( neighb, d ) )
+               stack.push_back( { neighb, d, 0 } ); // f is gone after this
+            continue;
+         }
+         int id = idOf( f.vtx );
+         if ( expandedBy[id] != i || expandedDepth[id] < f.depth )
+         {
+            expandedBy[id] = i;
+            expandedDepth[id] = f.depth;
+         }
+         stack.pop_back();
+      }
+      row.erase( row.begin() );
+   }
+   return Csr<VertexPtr>( rows );
 }
 
 int Graph::colorOf( const TilePtr& tile ) const
 {
-   Perm perm = GlobalSymmetry::colorPermOf( tile._Mtx );
-   return perm[_Tiles[tile._Index]._Color];
+   return MatrixIndexMap::permuteColor( tile._Elem, _Tiles[tile._Index]._Color );
 }
 
 vector<int> Graph::colorsAt( const VertexPtr& vtx ) const
 {
    vector<int> ret;
-   for ( const TilePtr& tile : tilesAt( vtx ) )
-      ret.push_back( colorOf( tile ) );
+   if ( !vtx.isValid() )
+      return ret;
+   for ( const TilePtr& tile : _VertexTiles[vtx._Index] )
+      ret.push_back( colorOf( tile.premul( vtx._Elem ) ) );
    return ret;
 }
 
 uint32_t Graph::colorBits( const VertexPtr& vtx ) const
 {
-   return toBitFlag( colorsAt( vtx ) );
+   return vtx.isValid() ? _ColorBits[idOf( vtx )] : 0;
 }
 
 vector<Graph::TilePtr> Graph::tilesAt( const VertexPtr& vtx ) const
@@ -244,66 +388,97 @@ vector<Graph::TilePtr> Graph::tilesAt( const VertexPtr& vtx ) const
       return {};
 
    vector<TilePtr> ret;   
-   for ( const TilePtr& tile : _Vertices[vtx._Index]._Tiles )
-      ret.push_back( tile.premul( vtx._Mtx ) );
+   for ( const TilePtr& tile : _VertexTiles[vtx._Index] )
+      ret.push_back( tile.premul( vtx._Elem ) );
    return ret;
 }
 
 Graph::TilePtr Graph::tileWithColor( const VertexPtr& vtx, int color ) const
 {
-   for ( const TilePtr& tile : tilesAt( vtx ) )
+   if ( !vtx.isValid() )
+      return TilePtr();
+
+   for ( const TilePtr& raw : _VertexTiles[vtx._Index] )
+   {
+      TilePtr tile = raw.premul( vtx._Elem );
       if ( colorOf( tile ) == color )
          return tile;
+   }
    return TilePtr();
 }
 
+// a and b have a (non blank) color in common, but on different tiles
 bool Graph::mustBeFar( const VertexPtr& a, const VertexPtr& b ) const
 {   
-   for ( const TilePtr& tileA : tilesAt( a ) ) if ( colorOf( tileA ) != BLANK_COLOR )
-   {
-      TilePtr tileB = tileWithColor( b, colorOf( tileA ) );
-      if ( tileB.isValid() && !eq( tileA, tileB ) )
+   if ( !a.isValid() || !b.isValid() )
+      return false;
+   int idA = idOf( a );
+   int idB = idOf( b );
+   uint32_t common = _ColorBits[idA] & _ColorBits[idB] & ~(1u << BLANK_COLOR);
+   for ( int color = 0; common; color++, common >>= 1 )
+      if ( (common & 1) && _TileIdAt[idA*MatrixIndexMap::NUM_COLORS+color] != _TileIdAt[idB*MatrixIndexMap::NUM_COLORS+color] )
          return true;
-   }
    return false;
 }
 
+// a and b are on the same tile
 bool Graph::mustBeClose( const VertexPtr& a, const VertexPtr& b ) const
 {
-   for ( const TilePtr& tileA : tilesAt( a ) )
-   {
-      TilePtr tileB = tileWithColor( b, colorOf( tileA ) );
-      if ( tileB.isValid() && eq( tileA, tileB ) )
+   if ( !a.isValid() || !b.isValid() )
+      return false;
+   int idA = idOf( a );
+   int idB = idOf( b );
+   uint32_t common = _ColorBits[idA] & _ColorBits[idB];
+   for ( int color = 0; common; color++, common >>= 1 )
+      if ( (common & 1) && _TileIdAt[idA*MatrixIndexMap::NUM_COLORS+color] == _TileIdAt[idB*MatrixIndexMap::NUM_COLORS+color] )
          return true;
-   }
    return false;
 }
 
+// fills _ColorBits and _TileIdAt for every copy of every vertex
+void Graph::calcColorTables()
+{
+   int n = (int) _Vertices.size() * MatrixIndexMap::size();
+   int numTiles = (int) _Tiles.size();
+   _ColorBits.assign( n, 0 );
+   _TileIdAt.assign( n * MatrixIndexMap::NUM_COLORS, -1 );
+   for ( int id = 0; id < n; id++ )
+   {
+      VertexPtr vtx = fromId( id );
+      for ( const TilePtr& raw : _VertexTiles[vtx._Index] )
+      {
+         TilePtr tile = raw.premul( vtx._Elem );
+         int color = colorOf( tile );
+         if ( (unsigned) color >= MatrixIndexMap::NUM_COLORS )
+            throw 777;
+         if ( _ColorBits[id] & (1u << color) )
+            continue; // like tileWithColor, the first tile with the color counts
+         _ColorBits[id] |= 1u << color;
+         _TileIdAt[id*MatrixIndexMap::NUM_COLORS+color] = _Tiles[tile._Index]._SymmetryMap->toReal( tile._Elem ) * numTiles + tile._Index;
+      }
+   }
+}
+
 bool Graph::eq( const TilePtr& a, const TilePtr& b ) const
 {
    if ( a._Index != b._Index )
       return false;
-   if ( _Tiles[a._Index]._SymmetryMap->match( a._Mtx, b._Mtx ) )
-      return true;
-   //return matrixId( a._Mtx ) == matrixId( b._Mtx );
-   return false;
+   return _Tiles[a._Index]._SymmetryMap->match( a._Elem, b._Elem );
 }
 
 bool Graph::eq( const VertexPtr& a, const VertexPtr& b ) const
 {
    if ( a._Index != b._Index )
       return false;
-   if ( _Vertices[a._Index]._IsSymmetrical )
-      return true;
-   return matrixId( a._Mtx ) == matrixId( b._Mtx );
+   return _Vertices[a._Index]._SymmetryMap->match( a._Elem, b._Elem );
 }
 
 vector<Graph::VertexPtr> Graph::allVertices() const
 {
    vector<VertexPtr> ret;
-   for ( const ISymmetry::Config& config : GlobalSymmetry::matrices() )
+   for ( int elem = 0; elem < MatrixIndexMap::size(); elem++ )
       for ( const Vertex& vtx : _Vertices )
-         ret.push_back( VertexPtr( vtx._Index, config.m ) );
+         ret.push_back( VertexPtr( vtx._Index, elem ) );
    return ret;
 }
 
@@ -311,7 +486,7 @@ vector<Graph::VertexPtr> Graph::rawVertices() const
 {
    vector<VertexPtr> ret;
    for ( const Vertex& vtx : _Vertices )
-      ret.push_back( VertexPtr( vtx._Index, QMtx4x4() ) );
+      ret.push_back( VertexPtr( vtx._Index, MatrixIndexMap::IDENTITY ) );
    return ret;
 }
 
@@ -319,25 +494,31 @@ vector<Graph::TilePtr> Graph::rawTiles() const
 {
    vector<TilePtr> ret;
    for ( int i = 0; i < (int) _Tiles.size(); i++ )
-      ret.push_back( TilePtr( i, QMtx4x4() ) );
+      ret.push_back( TilePtr( i, MatrixIndexMap::IDENTITY ) );
    return ret;
 }
 
 vector<Graph::TilePtr> Graph::allTiles() const
 {
    vector<TilePtr> ret;
-   for ( const ISymmetry::Config& config : GlobalSymmetry::matrices() )
+   for ( int elem = 0; elem < MatrixIndexMap::size(); elem++ )
       for ( int i = 0; i < (int) _Tiles.size(); i++ )
-         ret.push_back( TilePtr( i, QMtx4x4() ).premul( config.m ) );
+         ret.push_back( TilePtr( i, elem ) );
    return ret;
 }
 
-vector<Graph::KeepCloseFar> Graph::calcKeepCloseFars() const
+// the constraints of every raw vertex are collected separately and concatenated in vertex order, so the result doesn't depend on the threads
+vector<Graph::KeepCloseFar> Graph::calcKeepCloseFars( ThreadPool* pool, const ProgressCallback& progress ) const
 {
-   vector<KeepCloseFar> ret;
-   for ( const VertexPtr& vtx : rawVertices() )
-   {      
-      for ( const Graph::VertexPtr& neighb : neighbors( vtx, 5 ) )
+   SymmetryScope scope( _Group );
+   int numVertices = (int) _Vertices.size();
+   if ( numVertices )
+      neighborhood( 0, 5 ); // fill the cache before the threads read it
+
+   vector<vector<KeepCloseFar>> perVertex( numVertices );
+   parallelFor( numVertices, pool, _Group, "keep close/far", progress, [&]( int i ) {
+      VertexPtr vtx( i, MatrixIndexMap::IDENTITY );
+      for ( const Graph::VertexPtr& neighb : neighborhood( vtx._Index, 5 ) )
       {
          KeepCloseFar kcf;
          kcf.a = vtx;
@@ -345,27 +526,42 @@ vector<Graph::KeepCloseFar> Graph::calcKeepCloseFars() const
          kcf.keepClose = mustBeClose( vtx, neighb );
          kcf.keepFar = mustBeFar( vtx, neighb );
          if ( kcf.keepClose || kcf.keepFar )
-            ret.push_back( kcf );
+            perVertex[i].push_back( kcf );
       }
-   }
+   } );
+
+   vector<KeepCloseFar> ret;
+   for ( const vector<KeepCloseFar>& v : perVertex )
+      ret.insert( ret.end(), v.begin(), v.end() );
    return ret;
 }
 
-vector<Graph::LineVertexConstraint> Graph::calcLineVertexConstraints() const
+vector<Graph::LineVertexConstraint> Graph::calcLineVertexConstraints( ThreadPool* pool, const ProgressCallback& progress ) const
 {
-   vector<LineVertexConstraint> ret;
-   for ( const VertexPtr& a0 : rawVertices() )
-   {      
-      for ( const VertexPtr& a1 : neighbors( a0 ) ) if ( a0._Index <= a1._Index )
+   SymmetryScope scope( _Group );
+   int numVertices = (int) _Vertices.size();
+   if ( numVertices )
+      neighborhood( 0, 6 ); // fill the cache before the threads read it
+
+   vector<vector<LineVertexConstraint>> perVertex( numVertices );
+   parallelFor( numVertices, pool, _Group, "line/vertex", progress, [&]( int i ) {
+      VertexPtr a0( i, MatrixIndexMap::IDENTITY );
+      vector<LineVertexConstraint>& ret = perVertex[i];
+      Span<VertexPtr> row = _Neighbors[i];
+      for ( int k = 0; k < row.size(); k++ ) if ( a0._Index <= row[k]._Index )
       {
-         VertexPtr curveCenter = calcCurve( a0, a1 );
-         for ( const TilePtr& tile : tilesAt( a0, a1 ) )
+         const VertexPtr& a1 = row[k];
+         const EdgeInfo& edge = _Edges[_Neighbors._Offsets[i] + k];
+         const VertexPtr& curveCenter = edge.curveCenter;
+         for ( const TilePtr& tile : edge.tiles )
          {
             int color = colorOf( tile );
             if ( color == BLANK_COLOR )
                continue;
-            for ( const Graph::VertexPtr& neighb : neighbors( a0, 6 ) )
+            for ( const Graph::VertexPtr& neighb : neighborhood( a0._Index, 6 ) )
             {
+               if ( eq( neighb, a0 ) || eq( neighb, a1 ) )
+                  continue; // a copy of an end of the line at the same place
                TilePtr otherTile = tileWithColor( neighb, color );
                if ( !otherTile.isValid() )
                   continue;
@@ -386,7 +582,11 @@ vector<Graph::LineVertexConstraint> Graph::calcLineVertexConstraints() const
             }
          }
       }
-   }
+   } );
+
+   vector<LineVertexConstraint> ret;
+   for ( const vector<LineVertexConstraint>& v : perVertex )
+      ret.insert( ret.end(), v.begin(), v.end() );
    return ret;
 }
 
@@ -409,14 +609,15 @@ vector<pair<Graph::VertexPtr, Graph::VertexPtr>> Graph::calcPerimeter() const
    //}
    for ( const Tile& tile : _Tiles )
    {
-      for ( int i = 0; i < (int)tile._Vertices.size(); i++ )
+      Span<VertexPtr> vertices = _TileVertices[tile._Index];
+      for ( int i = 0; i < vertices.size(); i++ )
       {
-         VertexPtr a = tile._Vertices[i];
-         VertexPtr b = tile._Vertices[(i+1)%tile._Vertices.size()];
+         VertexPtr a = vertices[i];
+         VertexPtr b = vertices[(i+1)%vertices.size()];
          bool aOnPerim = false;
          bool bOnPerim = false;
-         for ( const TilePtr& t : tilesAt( a ) ) if ( matrixId( t._Mtx ) != matrixId( QMtx4x4() ) ) aOnPerim = true;
-         for ( const TilePtr& t : tilesAt( b ) ) if ( matrixId( t._Mtx ) != matrixId( QMtx4x4() ) ) bOnPerim = true;
+         for ( const TilePtr& t : tilesAt( a ) ) if ( t._Elem != MatrixIndexMap::IDENTITY ) aOnPerim = true;
+         for ( const TilePtr& t : tilesAt( b ) ) if ( t._Elem != MatrixIndexMap::IDENTITY ) bOnPerim = true;
          if ( aOnPerim && bOnPerim )
             ret.push_back( {a,b} );
       }
@@ -432,8 +633,8 @@ vector<Graph::TilePtr> Graph::tilesAt( const VertexPtr& a, const VertexPtr& b )
    for ( const TilePtr& tile : tilesAt( a ) )
    {
       bool bIsAlsoOnTile = false;
-      for ( const TilePtr& tileB : tilesAt( b ) )
-         if ( eq( tile, tileB ) )
+      for ( const TilePtr& tileB : _VertexTiles[b._Index] )
+         if ( eq( tile, tileB.premul( b._Elem ) ) )
             bIsAlsoOnTile = true;
       if ( bIsAlsoOnTile )
          ret.push_back( tile );
@@ -444,17 +645,51 @@ vector<Graph::TilePtr> Graph::tilesAt( const VertexPtr& a, const VertexPtr& b )
 vector<Graph::VertexPtr> Graph::verticesForTile( const TilePtr& tile ) const
 {
    vector<Graph::VertexPtr> ret;
-   for ( const VertexPtr& vtx : _Tiles[tile._Index]._Vertices )
-      ret.push_back( vtx.premul( tile._Mtx ) );
+   for ( const VertexPtr& vtx : _TileVertices[tile._Index] )
+      ret.push_back( vtx.premul( tile._Elem ) );
    return ret;
 }
 
-bool Graph::VertexPtr::operator==( const VertexPtr& rhs ) const
+// the edge from the identity copy of a._Index to b rotated back by a._Elem, as index into _Neighbors._Items, -1 if there is none
+int Graph::edgeId( const VertexPtr& a, const VertexPtr& b ) const
 {
-   return _Index == rhs._Index && matrixId( _Mtx ) == matrixId( rhs._Mtx );
+   if ( !a.isValid() || !b.isValid() )
+      return -1;
+
+   Span<VertexPtr> row = _Neighbors[a._Index];
+   for ( int k = 0; k < row.size(); k++ )
+      if ( eq( row[k].premul( a._Elem ), b ) )
+         return _Neighbors._Offsets[a._Index] + k;
+   return -1;
+}
+
+// fills _Edges for the edges of the identity copy of every vertex, they only change with the topology
+void Graph::calcEdges()
+{
+   _Edges.assign( _Neighbors._Items.size(), EdgeInfo() );
+   for ( int i = 0; i < (int) _Vertices.size(); i++ )
+   {
+      VertexPtr a( i, MatrixIndexMap::IDENTITY );
+      Span<VertexPtr> row = _Neighbors[i];
+      for ( int k = 0; k < row.size(); k++ )
+      {
+         EdgeInfo& edge = _Edges[_Neighbors._Offsets[i] + k];
+         edge.curveCenter = findCurveCenter( a, row[k] );
+         edge.tiles = tilesAt( a, row[k] );
+      }
+   }
 }
 
 Graph::VertexPtr Graph::calcCurve( const VertexPtr& a, const VertexPtr& b ) const
+{
+   int id = edgeId( a, b );
+   if ( id < 0 )
+      return VertexPtr();
+   const VertexPtr& center = _Edges[id].curveCenter;
+   return center.isValid() ? center.premul( a._Elem ) : center;
+}
+
+Graph::VertexPtr Graph::findCurveCenter( const VertexPtr& a, const VertexPtr& b ) const
 {
    vector<TilePtr> tiles = tilesAt( a, b );
    if ( tiles.size() != 2 )
@@ -467,8 +702,8 @@ Graph::VertexPtr Graph::calcCurve( const VertexPtr& a, const VertexPtr& b ) cons
          continue;
       for ( const VertexPtr& vtx : verticesForTile( tiles[tileIdx] ) )
       {
-         if ( vtx == a ) continue;
-         if ( vtx == b ) continue;
+         if ( eq( vtx, a ) ) continue;
+         if ( eq( vtx, b ) ) continue;
          //if ( mustBeFar( vtx, a ) && mustBeFar( vtx, b ) )
          //   return vtx; // wrong!
          vector<int> colors = colorsAt( vtx );
@@ -506,29 +741,24 @@ int Dual::Vertex::findNeighborIdx( const VertexPtr& a ) const
    return -1;
 }
 
-bool Dual::VertexPtr::operator==( const VertexPtr& rhs ) const
-{
-   return _Index == rhs._Index && matrixId( _Mtx ) == matrixId( rhs._Mtx );
-}
-
 
 bool Dual::isDuplicate( const VertexPtr& a ) const
 {
-   return !_Vertices[a._Index]._SymmetryMap->isReal( a._Mtx );
+   return !_Vertices[a._Index]._SymmetryMap->isReal( a._Elem );
 }
 
 Dual::VertexPtr Dual::toReal( const VertexPtr& a ) const
 {
-   return VertexPtr( a._Index, _Vertices[a._Index]._SymmetryMap->toReal( a._Mtx ) );
+   return VertexPtr( a._Index, _Vertices[a._Index]._SymmetryMap->toReal( a._Elem ) );
 }
 
 vector<Dual::VertexPtr> Dual::allVertices() const
 {
    vector<Dual::VertexPtr> ret;
    for ( const Vertex& vertex : _Vertices )
-   for ( const ISymmetry::Config& config : GlobalSymmetry::matrices() )
+   for ( int elem = 0; elem < MatrixIndexMap::size(); elem++ )
    {
-      VertexPtr a( vertex._Index, config.m );
+      VertexPtr a( vertex._Index, elem );
       if ( !isDuplicate( a ) )
          ret.push_back( a );
    }
@@ -537,14 +767,20 @@ vector<Dual::VertexPtr> Dual::allVertices() const
 
 XYZ Dual::posOf( const VertexPtr& vtx ) const
 {
-   return vtx._Mtx * _Vertices[vtx._Index]._Pos;
+   Q_ASSERT( isCurrent() );
+   return vtx.mtx() * _Vertices[vtx._Index]._Pos;
 }
 
 
 void Dual::setPos( const VertexPtr& vtx, const XYZ& pos )
 {
-   _Vertices[vtx._Index]._Pos = vtx._Mtx.inverted() * pos;
-   //return vtx._Mtx * _Vertices[vtx._Index]._Pos;
+   _Vertices[vtx._Index]._Pos = MatrixIndexMap::at( MatrixIndexMap::inverse( vtx._Elem ) ) * pos;
+
+   // the vertex and its neighbors see each other at new angles
+   set<int> changed = { vtx._Index };
+   for ( const VertexPtr& b : _Vertices[vtx._Index]._Ring )
+      changed.insert( b._Index );
+   updateRings( changed );
 }
 
 void Dual::toggleEdge( const VertexPtr& a, const VertexPtr& b, bool onlyAdd )
@@ -558,23 +794,27 @@ void Dual::toggleEdge( const VertexPtr& a, const VertexPtr& b, bool onlyAdd )
       return;
    }
 
-   VertexPtr bb = toReal( premul( b, a._Mtx.inverted() ) );
-   VertexPtr aa = toReal( premul( a, b._Mtx.inverted() ) );
+   VertexPtr bb = toReal( premul( b, MatrixIndexMap::inverse( a._Elem ) ) );
+   VertexPtr aa = toReal( premul( a, MatrixIndexMap::inverse( b._Elem ) ) );
 
    if ( _Vertices[a._Index].hasNeighbor( bb ) && _Vertices[b._Index].hasNeighbor( aa ) )
    {
-      if ( !onlyAdd )
-      {
-         _Vertices[a._Index].eraseNeighbor( bb );
-         _Vertices[b._Index].eraseNeighbor( aa );
-      }
+      if ( onlyAdd )
+         return;
+      _Vertices[a._Index].eraseNeighbor( bb );
+      _Vertices[b._Index].eraseNeighbor( aa );
    }
    else
    {   
       _Vertices[a._Index]._Neighbors.push_back( bb );
-      if ( idOf( aa ) != idOf( bb ) ) // don't double-add symmetric edge
+      bool isSymmetricEdge = false; // both ends are copies of the same vertex, and the edge maps onto itself
+      if ( a._Index == b._Index )
+         for ( int elem : _Vertices[a._Index]._SymmetryMap->symmetricMatrices( MatrixIndexMap::IDENTITY ) )
+            isSymmetricEdge |= idOf( premul( bb, elem ) ) == idOf( aa );
+      if ( !isSymmetricEdge ) // don't double-add symmetric edge
          _Vertices[b._Index]._Neighbors.push_back( aa ); 
    }
+   updateRings( { a._Index, b._Index } );
 }
 
 vector<Dual::VertexPtr> Dual::baseVertices() const
@@ -587,90 +827,383 @@ vector<Dual::VertexPtr> Dual::baseVertices() const
 
 vector<Dual::VertexPtr> Dual::neighborsOf( const VertexPtr& a ) const
 {
+   Q_ASSERT( isCurrent() );
    if ( !a.isValid() )
       return {};
 
    vector<VertexPtr> ret;
-   for ( const QMtx4x4& mtx : _Vertices[a._Index]._SymmetryMap->symmetricMatrices( a._Mtx ) )
+   for ( int elem : _Vertices[a._Index]._SymmetryMap->symmetricMatrices( a._Elem ) )
       for ( const VertexPtr& b : _Vertices[a._Index]._Neighbors )
-         ret.push_back( premul( b, mtx ) );
+         ret.push_back( premul( b, elem ) );
    return ret;
 }
 
 vector<Dual::VertexPtr> Dual::sortedNeighborsOf( const VertexPtr& a ) const
 {
-   vector<Dual::VertexPtr> v = neighborsOf( a );
-   
-   QMtx4x4 m = matrixRotateToZAxis( posOf( a ) );
+   Q_ASSERT( isCurrent() );
+   if ( !a.isValid() )
+      return {};
+
+   // the ring is already in order, it only has to start at the smallest angle
+   Rotation3 m = matrixRotateToZAxis( posOf( a ) );
    auto angleOf = [&]( const XYZ& p ) { XYZ q = m*p; return ::atan2( q.y, q.x ); };
-   
-   sort( v.begin(), v.end(), [&]( const Dual::VertexPtr& a, const Dual::VertexPtr& b ) { return angleOf( posOf( a ) ) < angleOf( posOf( b ) ); } );
+
+   vector<VertexPtr> v;
+   int first = 0;
+   double minAngle = 0;
+   for ( const VertexPtr& b : _Vertices[a._Index]._Ring )
+   {
+      v.push_back( premul( b, a._Elem ) );
+      double angle = angleOf( posOf( v.back() ) );
+      if ( v.size() == 1 || angle < minAngle )
+      {
+         first = (int) v.size() - 1;
+         minAngle = angle;
+      }
+   }
+   rotate( v.begin(), v.begin() + first, v.end() );
    return v;
 }
 
 int Dual::colorOf( const VertexPtr& vtx ) const
 {
-   Perm perm = GlobalSymmetry::colorPermOf( vtx._Mtx );
-   return perm[_Vertices[vtx._Index]._Color];
+   return MatrixIndexMap::permuteColor( vtx._Elem, _Vertices[vtx._Index]._Color );
 }
 
 void Dual::setColorOf( const VertexPtr& vtx, int color )
 {
-   Perm perm = GlobalSymmetry::colorPermOf( vtx._Mtx );
-   _Vertices[vtx._Index]._Color = perm.inverted()[color];
+   _Vertices[vtx._Index]._Color = MatrixIndexMap::unpermuteColor( vtx._Elem, color );
 }
 
 int Dual::idOf( const VertexPtr& a ) const
 {
    VertexPtr aa = toReal( a );
-   return MatrixIndexMap::indexOf( a._Mtx ) * _Vertices.size() + aa._Index;
+   return a._Elem * (int) _Vertices.size() + aa._Index;
 }
 
 Dual::VertexPtr Dual::fromId( int id ) const
 {
    int sz = (int) _Vertices.size();   
-   return VertexPtr( id % sz, MatrixIndexMap::at( id / sz ) );
+   return VertexPtr( id % sz, id / sz );
 }
 
 Dual::VertexPtr Dual::next( const VertexPtr& a, const VertexPtr& b ) const
 {
-   vector<VertexPtr> v = sortedNeighborsOf( a );
-   for ( int i = 0; i < (int)v.size(); i++ )
-      if ( idOf( v[i] ) == idOf( b ) )
-         return v[(i+1)%(int)v.size()];
-   return VertexPtr();
+   HalfEdge h = halfEdge( a, b );
+   if ( !h.isValid() )
+      return VertexPtr();
+   return targetOf( HalfEdge( h._Index, ( h._Slot+1 ) % (int) _Vertices[h._Index]._Ring.size(), h._Elem ) );
 }
 
 vector<Dual::VertexPtr> Dual::polygon( const VertexPtr& a, const VertexPtr& b ) const
 {
    vector<VertexPtr> ret = { b, a };
 
+   HalfEdge h = halfEdge( b, a );
    while ( true )
    {
-      VertexPtr c = next( ret.back(), ret[ret.size()-2] );
+      h = next( h );
+      if ( !h.isValid() )
+         return ret;
+      VertexPtr c = targetOf( h );
       if ( idOf( c ) == idOf( ret[0] ) )
          return ret;
       ret.push_back( c );
    }
 }
 
-Dual::VertexPtr Dual::premul( const VertexPtr& vtx, const QMtx4x4& mtx ) const 
+Dual::HalfEdge Dual::halfEdge( const VertexPtr& a, const VertexPtr& b ) const
+{
+   if ( !a.isValid() || !b.isValid() )
+      return HalfEdge();
+
+   const vector<VertexPtr>& ring = _Vertices[a._Index]._Ring;
+   for ( int k = 0; k < (int) ring.size(); k++ )
+      if ( idOf( premul( ring[k], a._Elem ) ) == idOf( b ) )
+         return HalfEdge( a._Index, k, a._Elem );
+   return HalfEdge();
+}
+
+Dual::VertexPtr Dual::originOf( const HalfEdge& h ) const
+{
+   return toReal( VertexPtr( h._Index, h._Elem ) );
+}
+
+Dual::VertexPtr Dual::targetOf( const HalfEdge& h ) const
+{
+   return premul( _Vertices[h._Index]._Ring[h._Slot], h._Elem );
+}
+
+Dual::HalfEdge Dual::twin( const HalfEdge& h ) const
+{
+   const Vertex& a = _Vertices[h._Index];
+   const VertexPtr& b = a._Ring[h._Slot];
+   return HalfEdge( b._Index, a._Twins[h._Slot], MatrixIndexMap::mul( h._Elem, b._Elem ) );
+}
+
+Dual::HalfEdge Dual::next( const HalfEdge& h ) const
+{
+   HalfEdge t = twin( h );
+   if ( !t.isValid() )
+      return HalfEdge();
+   return HalfEdge( t._Index, ( t._Slot+1 ) % (int) _Vertices[t._Index]._Ring.size(), t._Elem );
+}
+
+void Dual::sortRing( int idx )
+{
+   Vertex& a = _Vertices[idx];
+   a._Ring = neighborsOf( a.toVertexPtr() );
+
+   Rotation3 m = matrixRotateToZAxis( a._Pos );
+   auto angleOf = [&]( const XYZ& p ) { XYZ q = m*p; return ::atan2( q.y, q.x ); };
+
+   sort( a._Ring.begin(), a._Ring.end(), [&]( const Dual::VertexPtr& a, const Dual::VertexPtr& b ) { return angleOf( posOf( a ) ) < angleOf( posOf( b ) ); } );
+   a._Twins.assign( a._Ring.size(), -1 );
+}
+
+void Dual::linkRing( int idx )
+{
+   Vertex& a = _Vertices[idx];
+   int id = idOf( a.toVertexPtr() );
+   for ( int k = 0; k < (int) a._Ring.size(); k++ )
+   {
+      const VertexPtr& b = a._Ring[k];
+      const vector<VertexPtr>& ring = _Vertices[b._Index]._Ring;
+      a._Twins[k] = -1;
+      for ( int s = 0; s < (int) ring.size() && a._Twins[k] < 0; s++ )
+         if ( idOf( premul( ring[s], b._Elem ) ) == id )
+            a._Twins[k] = s;
+   }
+}
+
+// re-sorts the rings of the changed vertices, the twins of their neighbors point into them as well
+void Dual::updateRings( const set<int>& changed )
+{
+   set<int> toLink = changed;
+   for ( int idx : changed )
+   {
+      sortRing( idx );
+      for ( const VertexPtr& b : _Vertices[idx]._Ring )
+         toLink.insert( b._Index );
+   }
+   for ( int idx : toLink )
+      linkRing( idx );
+}
+
+void Dual::calcRings()
+{
+   for ( const Vertex& a : _Vertices )
+      sortRing( a._Index );
+   for ( const Vertex& a : _Vertices )
+      linkRing( a._Index );
+}
+
+Dual::VertexPtr Dual::premul( const VertexPtr& vtx, int elem ) const 
 { 
-   return toReal( VertexPtr( vtx._Index, mtx * vtx._Mtx ) ); 
+   Q_ASSERT( isCurrent() );
+   return toReal( VertexPtr( vtx._Index, MatrixIndexMap::mul( elem, vtx._Elem ) ) ); 
 }
 
+// the last vertex takes the place of the deleted one, so only the neighbors of the two have to be touched
 void Dual::deleteVertex( int idx )
 {
-   auto newIndex = [&]( int i ){ return i > idx ? i-1 : i; };
+   int last = (int) _Vertices.size() - 1;
+
+   set<int> changed;
+   for ( const VertexPtr& b : _Vertices[idx]._Ring )
+      changed.insert( b._Index );
+   changed.erase( idx );
+   for ( int i : changed )
+   {
+      vector<VertexPtr>& neighbors = _Vertices[i]._Neighbors;
+      neighbors.erase( remove_if( neighbors.begin(), neighbors.end(), [&]( const VertexPtr& a ) { return a._Index == idx; } ), neighbors.end() );
+   }
+
+   if ( idx != last )
+   {
+      set<int> lastNeighbors;
+      for ( const VertexPtr& b : _Vertices[last]._Ring )
+         if ( b._Index != idx )
+            lastNeighbors.insert( b._Index == last ? idx : b._Index );
+
+      _Vertices[idx] = move( _Vertices[last] );
+      _Vertices[idx]._Index = idx;
+      for ( int i : lastNeighbors )
+      {
+         for ( VertexPtr& b : _Vertices[i]._Neighbors ) if ( b._Index == last ) b._Index = idx;
+         for ( VertexPtr& b : _Vertices[i]._Ring )      if ( b._Index == last ) b._Index = idx;
+      }
+      if ( changed.erase( last ) )
+         changed.insert( idx );
+   }
+   _Vertices.pop_back();
+
+   updateRings( changed );
+}
+
+
+namespace
+{
+   // a face of the dual, keyed by its orbit under the symmetry
+   // - the key is the smallest of the sorted vertex ids of all copies of the face, so every copy of a face gets the same key
+   // - ids are a set, a broken dual can have faces that pass a vertex twice
+   struct Face
+   {
+      Face( const Dual& dual, const vector<Dual::VertexPtr>& polygon ) : _Polygon( polygon )
+      {
+         vector<int> ids;
+         for ( int elem = 0; elem < MatrixIndexMap::size(); elem++ )
+         {
+            ids.clear();
+            for ( const Dual::VertexPtr& c : polygon )
+               ids.push_back( dual.idOf( dual.premul( c, elem ) ) );
+            sort( ids.begin(), ids.end() );
+            ids.erase( unique( ids.begin(), ids.end() ), ids.end() );
+            if ( _ToKey.empty() || ids < _Key )
+            {
+               _Key = ids;
+               _ToKey.clear();
+            }
+            if ( ids == _Key )
+               _ToKey.push_back( elem );
+         }
+      }
+
+      struct KeyHash
+      {
+         size_t operator()( const vector<int>& key ) const
+         {
+            uint64_t ret = 14695981039346656037ull; // FNV-1a
+            for ( int id : key )
+               ret = ( ret ^ (uint32_t) id ) * 1099511628211ull;
+            return (size_t) ret;
+         }
+      };
+
+      vector<Dual::VertexPtr> _Polygon;
+      vector<int> _Key;
+      vector<int> _ToKey; // the elements that map the face to its key (more than one if the face has symmetry)
+   };
+}
+
+// adds b to the neighbors of a (relative to the identity copy of a)
+static void addNeighbor( const Graph& graph, vector<vector<Graph::VertexPtr>>& neighbors, const Graph::VertexPtr& a, const Graph::VertexPtr& b )
+{
+   Graph::VertexPtr bb = b.premul( MatrixIndexMap::inverse( a._Elem ) );
+
+   if ( a == b )
+      qDebug( "addNeighbor dup" );
+   
+   for ( const Graph::VertexPtr& v : neighbors[a._Index] )
+      if ( graph.eq( bb, v ) )
+         return; // already have it
 
-   _Vertices.erase( _Vertices.begin() + idx );
-   for ( Vertex& vtx : _Vertices )
+   neighbors[a._Index].push_back( bb );
+}
+
+shared_ptr<Graph> makeGraph( shared_ptr<const Dual> dual, double radius, ThreadPool* pool, const ProgressCallback& progress )
+{
+   SymmetryScope scope( dual->_Group );
+   shared_ptr<Graph> graph( new Graph );
+   graph->_Group = dual->_Group;
+   
+   // the face walks and orbit keys are independent, only matching the faces to graph vertices has to be done in order
+   int numDualVertices = (int) dual->_Vertices.size();
+   vector<vector<Face>> faces( numDualVertices ); // dual vertex -> the faces around it
+   parallelFor( numDualVertices, pool, dual->_Group, "faces", progress, [&]( int k ) {
+      Dual::VertexPtr a = dual->fromId( k );
+      for ( const Dual::VertexPtr& b : dual->sortedNeighborsOf( a ) )
+         faces[k].push_back( Face( *dual, dual->polygon( a, b ) ) );
+   } );
+
+   struct Found { int index; int elem; }; // graph vertex, and an element that maps the face it was made from to the key
+   unordered_map<vector<int>, Found, Face::KeyHash> keyToVertex;
+   vector<vector<Graph::VertexPtr>> neighbors;    // rows of graph->_Neighbors
+   vector<vector<Graph::TilePtr>> vertexTiles;    // rows of graph->_VertexTiles
+   vector<vector<Graph::VertexPtr>> tileVertices; // rows of graph->_TileVertices
+
+   for ( int k = 0; k < numDualVertices; k++ )
    {
-      vtx._Index = newIndex( vtx._Index );
-      
-      vtx._Neighbors.erase( remove_if( vtx._Neighbors.begin(), vtx._Neighbors.end(), [&]( const VertexPtr& a ) { return a._Index == idx; } ), vtx._Neighbors.end() );
+      Dual::VertexPtr a = dual->fromId( k );
+      if ( progress )
+         progress( "tiles", k, numDualVertices );
 
-      for ( auto& b : vtx._Neighbors )
-         b._Index = newIndex( b._Index );
+      Graph::Tile tile;
+      tile._Index = (int) graph->_Tiles.size();
+      tile._Color = dual->colorOf( a );
+      tile._SymmetryMap = dual->_Vertices[a._Index]._SymmetryMap;
+      tileVertices.emplace_back();
+
+      for ( const Face& face : faces[k] )
+      {
+         Graph::VertexPtr tileVertex;
+         auto it = keyToVertex.find( face._Key );
+         if ( it != keyToVertex.end() )
+         {
+            // elem maps this face onto the one the vertex was made from, take the smallest if the face has symmetry
+            int elem = MatrixIndexMap::size();
+            for ( int toKey : face._ToKey )
+               elem = min( elem, MatrixIndexMap::mul( MatrixIndexMap::inverse( it->second.elem ), toKey ) );
+            tileVertex = Graph::VertexPtr( it->second.index, MatrixIndexMap::inverse( elem ) );
+         }
+
+         if ( !tileVertex.isValid() ) // create it if needed
+         {
+            XYZ sum;
+            for ( const Dual::VertexPtr& c : face._Polygon )
+               sum += dual->posOf( c );
+
+            Graph::Vertex v( (int) graph->_Vertices.size() );
+            v._SymmetryMap = MatrixSymmetryMap::symmetryFor( sum );
+            v._IsSymmetrical = v._SymmetryMap->hasSymmetry();
+            v._Pos = sum.normalized() * radius;
+            graph->_Vertices.push_back( v );
+            neighbors.emplace_back();
+            vertexTiles.emplace_back();
+            tileVertex = Graph::VertexPtr( v._Index, MatrixIndexMap::IDENTITY );
+            keyToVertex[face._Key] = Found { v._Index, face._ToKey[0] };
+         }
+
+         tileVertices.back().push_back( tileVertex );         
+      }
+      graph->_Tiles.push_back( tile );
+      const vector<Graph::VertexPtr>& vertices = tileVertices.back();
+      for ( const Graph::VertexPtr& vtx : vertices )
+         if ( tile._SymmetryMap->isReal( vtx._Elem ) ) // only add one copy
+            vertexTiles[vtx._Index].push_back( Graph::TilePtr( tile._Index, MatrixIndexMap::inverse( vtx._Elem ) ) );
+      for ( int i = 0; i < (int) vertices.size(); i++ )
+         addNeighbor( *graph, neighbors, vertices[i], vertices[(i+1)%vertices.size()] );
+   }
+
+   // a vertex on a rotation axis only got the tiles and neighbors of the faces it was made from, the copies of those under its stabilizer are the rest
+   for ( const Graph::Vertex& v : graph->_Vertices ) if ( v._IsSymmetrical )
+   {
+      vector<Graph::VertexPtr> found = neighbors[v._Index];
+      vector<Graph::TilePtr> foundTiles = vertexTiles[v._Index];
+      for ( int elem : v._SymmetryMap->symmetricMatrices( MatrixIndexMap::IDENTITY ) )
+      {
+         for ( const Graph::VertexPtr& b : found )
+            addNeighbor( *graph, neighbors, Graph::VertexPtr( v._Index, MatrixIndexMap::IDENTITY ), b.premul( elem ) );
+         for ( const Graph::TilePtr& tile : foundTiles )
+         {
+            Graph::TilePtr copy = tile.premul( elem );
+            vector<Graph::TilePtr>& row = vertexTiles[v._Index];
+            if ( find_if( row.begin(), row.end(), [&]( const Graph::TilePtr& t ) { return graph->eq( t, copy ); } ) == row.end() )
+               row.push_back( copy );
+         }
+      }
    }
-}
\ No newline at end of file
+
+   graph->_Neighbors = Csr<Graph::VertexPtr>( neighbors );
+   graph->_VertexTiles = Csr<Graph::TilePtr>( vertexTiles );
+   graph->_TileVertices = Csr<Graph::VertexPtr>( tileVertices );
+   graph->calcColorTables();
+   graph->calcEdges();
+
+
+//   for ( const Graph::VertexPtr& a : graph->allVertices() )
+//      for ( const Graph::VertexPtr& b : graph->neighbors( a ) )
+//         qDebug() << graph->idOf( a ) << "-" << graph->idOf( b );
+
+   return graph;
+}
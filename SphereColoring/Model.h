@@ -1,12 +1,16 @@
 #pragma once
 
 #include <vector>
+#include <map>
+#include <set>
+#include <algorithm>
 #include <QDebug>
 #include <QMatrix4x4>
 #include <QPolygon>
 #include <unordered_map>
 #include <unordered_set>
 #include <functional>
+#include <mutex>
 #include "DataTypes.h"
 
 using namespace std;
@@ -65,26 +69,26 @@ const double PHI = .5 + sqrt(1.25);
 
 //typedef QVector3D XYZ;
 //typedef QMatrix4x4 QMtx4x4;
-typedef Matrix4x4 QMtx4x4;
+typedef Matrix4x4 QMtx4x4; // only for the projection to the bitmap, the model layer uses Rotation3
 
 
 
 bool isClockwiseTri( const QPolygonF& poly );
 
-QMtx4x4 toMatrix( const XYZ& a, const XYZ& b, const XYZ& c );
-QMtx4x4 translation( const XYZ& p );
-QMtx4x4 map( const vector<XYZ>& a, const vector<XYZ>& b );
-QMtx4x4 matrixRotateToZAxis( XYZ& p );
-QMtx4x4 pow( const QMtx4x4& m, int power );
-bool fuzzyCompare( const QMtx4x4& a, const QMtx4x4& b );
-bool isIdentity( const QMtx4x4& a );
+Rotation3 toMatrix( const XYZ& a, const XYZ& b, const XYZ& c );
+Rotation3 frameOf( const XYZ& u, const XYZ& v );
+Rotation3 map( const vector<XYZ>& a, const vector<XYZ>& b );
+Rotation3 matrixRotateToZAxis( const XYZ& p );
+Rotation3 pow( const Rotation3& m, int power );
+bool fuzzyCompare( const Rotation3& a, const Rotation3& b );
+bool isIdentity( const Rotation3& a );
 static XYZ operator*( const QMtx4x4& m, const XYZ& p ) 
 { 
    //QVector3D ret = m * QVector3D( p.x, p.y, p.z );
    //return XYZ( ret.x(), ret.y(), ret.z() );
    return (m * XYZW( p )).toXYZ();
 }
-static vector<XYZ> operator*( const QMtx4x4& m, const vector<XYZ>& v ) 
+static vector<XYZ> operator*( const Rotation3& m, const vector<XYZ>& v ) 
 { 
    vector<XYZ> ret;
    for ( const XYZ& p : v )
@@ -97,7 +101,7 @@ class ISymmetry
 public:
    struct Config
    {
-      QMtx4x4 m;
+      Rotation3 m;
       vector<int> state;
       Perm colorPerm;
       bool isHomeState() const 
@@ -111,111 +115,66 @@ public:
 
 public:
    virtual string name() const = 0;
-   virtual Perm colorPermOf( const QMtx4x4& m ) const = 0;
-   virtual vector<Config> matrices() const = 0;
+   virtual Perm colorPermOf( const Rotation3& m ) const = 0;
+   virtual const vector<Config>& matrices() const = 0;
    virtual vector<XYZ> sectorOutline() const = 0;
    virtual vector<XYZ> symmetryPoints() const = 0;
 };
 
 
-uint64_t matrixId( const QMtx4x4& m );
+uint64_t matrixId( const Rotation3& m );
 
-class Rot3Symmetry : public ISymmetry
+class MatrixSymmetryMap;
+
+// rotation group given by generators and the color permutations they induce
+// - the elements are enumerated once by closure, element 0 is the identity
+class GroupSymmetry : public ISymmetry
 {
 public:
-   Rot3Symmetry()
-   {
-      int N = 3;
-      const double PI = acos(0.) * 2.;
-      _Rot = QMtx4x4::rotationY( 2*PI/N );
-      _Perm = Perm( {1,2,0,4,5,3,6} );
-
-      for ( int i = 0; i < N; i++ )
-      {
-         _Configs.push_back( Config { _Rot.pow( i ), {i}, _Perm.pow( i ) } );
-      }
-
-      for ( int i = 0; i < (int) _Configs.size(); i++ )
-      {
-         _MatrixIdToConfigIndex[matrixId(_Configs[i].m)] = i;
-      }
-   }
-
-   string name() const override { return "rot3"; }
-   Perm colorPermOf( const QMtx4x4& m ) const override
-   {      
-      uint64_t id = matrixId( m );
-      if ( !_MatrixIdToConfigIndex.count( id ) )
-         throw 777;
-      return _Configs[_MatrixIdToConfigIndex.at(id)].colorPerm;
-   }
-   vector<Config> matrices() const override
-   {
-      return _Configs;
-   }
-   vector<XYZ> sectorOutline() const override
-   {
-      return { XYZ(0,1,0), XYZ(0,0,1), XYZ(0,-1,0), XYZ(0,0,1) };
-   }
-   vector<XYZ> symmetryPoints() const override
+   struct Generator
    {
-      return { XYZ(0,1,0), XYZ(0,-1,0) };
-   }
-
-public:
-   QMtx4x4 _Rot;
-   Perm _Perm;
-   vector<Config> _Configs;
-   unordered_map<uint64_t, int> _MatrixIdToConfigIndex;
-};
+      Rotation3 m;
+      Perm colorPerm;
+   };
 
-class Rot5Symmetry : public ISymmetry
-{
 public:
-   Rot5Symmetry()
-   {
-      int N = 5;
-      const double PI = acos(0.) * 2.;
-      _Rot = QMtx4x4::rotationY( 2*PI/N );
-      _Perm = Perm( {1,2,3,4,0,5,6} );
+   static const int MAX_N = 12; // matrixId can't tell the rotations of larger rot<n>/dih<n> apart
 
-      for ( int i = 0; i < N; i++ )
-      {
-         _Configs.push_back( Config { _Rot.pow( i ), {i}, _Perm.pow( i ) } );
-      }
+   GroupSymmetry( const string& name, const vector<Generator>& generators, const vector<XYZ>& sectorOutline, const vector<XYZ>& symmetryPoints );
 
-      for ( int i = 0; i < (int) _Configs.size(); i++ )
-      {
-         _MatrixIdToConfigIndex[matrixId(_Configs[i].m)] = i;
-      }
-   }
+   static shared_ptr<GroupSymmetry> cyclic( int n, const Perm& colorPerm = Perm() );
+   static shared_ptr<GroupSymmetry> dihedral( int n );
+   static shared_ptr<GroupSymmetry> tetrahedral();
+   static shared_ptr<GroupSymmetry> octahedral();
+   static shared_ptr<GroupSymmetry> fromName( const string& name ); // rot<n>, dih<n> (n <= MAX_N), tetra12 or octa24, nullptr otherwise
 
-   string name() const override { return "rot5"; }
-   Perm colorPermOf( const QMtx4x4& m ) const override
+   string name() const override { return _Name; }
+   Perm colorPermOf( const Rotation3& m ) const override
    {      
       uint64_t id = matrixId( m );
       if ( !_MatrixIdToConfigIndex.count( id ) )
          throw 777;
       return _Configs[_MatrixIdToConfigIndex.at(id)].colorPerm;
    }
-   vector<Config> matrices() const override
+   const vector<Config>& matrices() const override
    {
       return _Configs;
    }
    vector<XYZ> sectorOutline() const override
    {
-      return { XYZ(0,1,0), XYZ(0,0,1), XYZ(0,-1,0), XYZ(0,0,1) };
+      return _SectorOutline;
    }
    vector<XYZ> symmetryPoints() const override
    {
-      return { XYZ(0,1,0), XYZ(0,-1,0) };
+      return _SymmetryPoints;
    }
 
 public:
-   QMtx4x4 _Rot;
-   Perm _Perm;
+   string _Name;
    vector<Config> _Configs;
    unordered_map<uint64_t, int> _MatrixIdToConfigIndex;
+   vector<XYZ> _SectorOutline;
+   vector<XYZ> _SymmetryPoints;
 };
 
 class IcoSymmetry : public ISymmetry
@@ -235,14 +194,20 @@ public:
              , XYZ(   PHI,   -1,    0 )  
              , XYZ(   PHI,    1,    0 )  
              , XYZ(     0,  PHI,    1 ) };
+      _Configs = calcMatrices();
    }
    string name() const override { return "ico60"; }
    XYZ operator[]( int idx ) const { return _Pts[idx]; }
-   QMtx4x4 map( const vector<int>& a, const vector<int>& b ) const
+   Rotation3 map( const vector<int>& a, const vector<int>& b ) const
    {
       return ::map( vector<XYZ> { _Pts[a[0]], _Pts[a[1]], _Pts[a[2]] }, vector<XYZ> { _Pts[b[0]], _Pts[b[1]], _Pts[b[2]] } );
    }
-   vector<Config> matrices() const override
+   const vector<Config>& matrices() const override
+   {
+      return _Configs;
+   }
+   // the saved duals refer to the elements by index, so this keeps its own order instead of using GroupSymmetry
+   vector<Config> calcMatrices() const
    {
       vector<Config> ret;
 
@@ -251,7 +216,7 @@ public:
       for ( int sym2 : { 0, 1 } )
       for ( int sym3 : { 0, 1, 2, 3, 4 } )
       {
-         QMtx4x4 m = pow( map( {0,1,2}, {3,0,2} ), sym3 )
+         Rotation3 m = pow( map( {0,1,2}, {3,0,2} ), sym3 )
                    * pow( map( {0,1,2}, {7,6,8} ), sym2 )
                    * pow( map( {0,1,2}, {1,0,5} ), sym1 )
                    * pow( map( {0,1,2}, {1,2,0} ), sym0 );
@@ -293,7 +258,7 @@ public:
       return 4;
    }
 
-   Perm tetrColorPermOf( const QMtx4x4& m ) const
+   Perm tetrColorPermOf( const Rotation3& m ) const
    {
       XYZ p012 = m * (_Pts[0]+_Pts[1]+_Pts[2]);
       XYZ p023 = m * (_Pts[0]+_Pts[2]+_Pts[3]);
@@ -304,7 +269,7 @@ public:
       return Perm( {tetrColorOf(p012),tetrColorOf(p023),tetrColorOf(p034),tetrColorOf(p045),tetrColorOf(p051),5,6} );  
    }
 
-   Perm colorPermOf( const QMtx4x4& m ) const override
+   Perm colorPermOf( const Rotation3& m ) const override
    {            
       return Perm( { id( m*_Pts[0] )%6, id( m*_Pts[1] )%6, id( m*_Pts[2] )%6, id( m*_Pts[3] )%6, id( m*_Pts[4] )%6, id( m*_Pts[5] )%6, 6} );        
       //return tetrColorPermOf( m );
@@ -328,20 +293,95 @@ public:
 
 public:
    vector<XYZ> _Pts;
+   vector<Config> _Configs;
 };
 
-class GlobalSymmetry
+uint64_t matrixId( const Rotation3& m );
+
+class MatrixSymmetryMap;
+
+// the elements of a symmetry group, referred to by index
+// - element 0 is the identity
+// - products and inverses are table lookups (Cayley table built once per symmetry)
+// - every Dual and Graph keeps the context it was made in, the static accessors use the one current in the calling thread
+class MatrixIndexMap
 {
+public:
+   MatrixIndexMap( const shared_ptr<ISymmetry>& symmetry )
+   {
+      _Symmetry = symmetry;
+      _Matrices = symmetry->matrices();
+      int n = (int) _Matrices.size();
+      for ( int i = 0; i < n; i++ )
+         _MatrixIdToIndex[matrixId( _Matrices[i].m )] = i;
+      if ( !isIdentity( _Matrices[IDENTITY].m ) || (int) _MatrixIdToIndex.size() != n )
+         throw 777;
+
+      _Product.resize( n * n );
+      _Inverse.resize( n );
+      for ( int a = 0; a < n; a++ )
+         for ( int b = 0; b < n; b++ )
+         {
+            _Product[a*n+b] = indexOfMatrix( _Matrices[a].m * _Matrices[b].m );
+            if ( _Product[a*n+b] == IDENTITY )
+               _Inverse[a] = b;
+         }
+
+      _ColorTable.resize( n * NUM_COLORS );
+      _InverseColorTable.resize( n * NUM_COLORS );
+      for ( int a = 0; a < n; a++ )
+         for ( int color = 0; color < NUM_COLORS; color++ )
+         {
+            int permuted = _Matrices[a].colorPerm[color];
+            if ( permuted >= NUM_COLORS )
+               throw 777;
+            _ColorTable[a*NUM_COLORS+color] = permuted;
+            _InverseColorTable[a*NUM_COLORS+permuted] = color;
+         }
+   }
+
 private:
-   //GlobalSymmetry() { _Symmetry.reset( new IcoSymmetry ); }
-   GlobalSymmetry() { _Symmetry.reset( new Rot3Symmetry ); }
-   //GlobalSymmetry() { _Symmetry.reset( new Rot5Symmetry ); }
+   int indexOfMatrix( const Rotation3& m ) const { return _MatrixIdToIndex.at( matrixId( m ) ); }
+
+public:
+   static const int IDENTITY = 0;
+   static const int NUM_COLORS = BLANK_COLOR+1; // size of the color tables, colors beyond that map to themselves
 
+   static shared_ptr<MatrixIndexMap>& current()
+   {
+      //static thread_local shared_ptr<MatrixIndexMap> s_current( new MatrixIndexMap( shared_ptr<ISymmetry>( new IcoSymmetry ) ) );
+      static thread_local shared_ptr<MatrixIndexMap> s_current( new MatrixIndexMap( GroupSymmetry::fromName( "rot3" ) ) );
+      //static thread_local shared_ptr<MatrixIndexMap> s_current( new MatrixIndexMap( GroupSymmetry::fromName( "rot5" ) ) );
+      return s_current;
+   }
+   static MatrixIndexMap& theInstance() { return *current(); }
+   static int size() { return (int) theInstance()._Matrices.size(); }
+   static int indexOf( const Rotation3& m ) { return theInstance().indexOfMatrix( m ); }
+   static const Rotation3& at( int index ) { return theInstance()._Matrices[index].m; }
+   static int mul( int a, int b ) { const MatrixIndexMap& map = theInstance(); return map._Product[a*map._Matrices.size()+b]; } // index of at(a) * at(b)
+   static int inverse( int a ) { return theInstance()._Inverse[a]; }
+   static const Perm& colorPerm( int index ) { return theInstance()._Matrices[index].colorPerm; }
+   static int permuteColor( int index, int color ) { return (unsigned) color < NUM_COLORS ? theInstance()._ColorTable[index*NUM_COLORS+color] : color; } // colorPerm( index )[color]
+   static int unpermuteColor( int index, int color ) { return (unsigned) color < NUM_COLORS ? theInstance()._InverseColorTable[index*NUM_COLORS+color] : color; } // colorPerm( index ).inverted()[color]
+
+public:
+   shared_ptr<ISymmetry> _Symmetry;
+   vector<ISymmetry::Config> _Matrices;
+   unordered_map<uint64_t, int> _MatrixIdToIndex;
+   vector<int> _Product; // a*size()+b -> mul(a,b)
+   vector<int> _Inverse;
+   vector<int> _ColorTable; // index*NUM_COLORS+color -> permuteColor(index,color)
+   vector<int> _InverseColorTable;
+   std::map<vector<int>, shared_ptr<MatrixSymmetryMap>> _SymmetryMaps; // stabilizer -> coset tables shared by all points with that stabilizer
+};
+
+// the symmetry of the context that is current in this thread (see MatrixIndexMap::current)
+class GlobalSymmetry
+{
 public:
-   static GlobalSymmetry& theInstance() { static GlobalSymmetry s_theInstance; return s_theInstance; }
-   static ISymmetry* symmetry() { return theInstance()._Symmetry.get(); }
-   static Perm colorPermOf( const QMtx4x4& m ) { return symmetry()->colorPermOf( m ); }
-   static vector<ISymmetry::Config> matrices() { return symmetry()->matrices(); }
+   static ISymmetry* symmetry() { return MatrixIndexMap::theInstance()._Symmetry.get(); }
+   static Perm colorPermOf( const Rotation3& m ) { return symmetry()->colorPermOf( m ); }
+   static const vector<ISymmetry::Config>& matrices() { return symmetry()->matrices(); }
    static vector<XYZ> sectorOutline( double radius ) 
    { 
       vector<XYZ> ret = symmetry()->sectorOutline(); 
@@ -356,76 +396,61 @@ public:
          p = p.normalized() * radius;
       return ret;
    }   
+   static shared_ptr<ISymmetry> fromName( const string& name )
+   {
+      shared_ptr<ISymmetry> ret = GroupSymmetry::fromName( name );
+      if ( !ret )
+         ret.reset( new IcoSymmetry );
+      return ret;
+   }
+   // only affects the calling thread, duals and graphs made before keep their context
    static void setSymmetry( const string& name )
    {      
-      if      ( name == Rot3Symmetry().name() ) theInstance()._Symmetry.reset( new Rot3Symmetry );
-      else if ( name == Rot5Symmetry().name() ) theInstance()._Symmetry.reset( new Rot5Symmetry );
-      else                                      theInstance()._Symmetry.reset( new IcoSymmetry );
+      MatrixIndexMap::current().reset( new MatrixIndexMap( fromName( name ) ) );
    }
-      
-public:
-   shared_ptr<ISymmetry> _Symmetry;
 };
 
-uint64_t matrixId( const QMtx4x4& m );
-
-class MatrixIndexMap
+// makes a context current in this thread until the end of the scope
+// - needed to work on a Dual or Graph from a thread whose current context is another one
+class SymmetryScope
 {
-private:
-   MatrixIndexMap()
-   {
-      _Matrices = GlobalSymmetry::matrices();
-      for ( int i = 0; i < (int) _Matrices.size(); i++ )
-         _MatrixIdToIndex[matrixId( _Matrices[i].m )] = i;
-   }
 public:
-   static MatrixIndexMap& theInstance() { static MatrixIndexMap s_theInstance; return s_theInstance; }
-   static void update() { theInstance() = MatrixIndexMap(); }
-   static int indexOf( const QMtx4x4& m ) 
-   { 
-      int id = matrixId( m );
-      //assert( theInstance()._MatrixIdToIndex.count( id );
-      return theInstance()._MatrixIdToIndex.at( id ); 
-   }
-   static QMtx4x4 at( int index ) { return theInstance()._Matrices[index].m; }
+   SymmetryScope( const shared_ptr<MatrixIndexMap>& group ) : _Previous( MatrixIndexMap::current() ) { if ( group ) MatrixIndexMap::current() = group; }
+   ~SymmetryScope() { MatrixIndexMap::current() = _Previous; }
+   SymmetryScope( const SymmetryScope& ) = delete;
+   SymmetryScope& operator=( const SymmetryScope& ) = delete;
 
-public:
-   vector<ISymmetry::Config> _Matrices;
-   unordered_map<uint64_t, int> _MatrixIdToIndex;
+private:
+   shared_ptr<MatrixIndexMap> _Previous;
 };
 
 class MatrixSymmetryMap
 {
 public:
-   MatrixSymmetryMap( const XYZ& symmetricalPt )
-   {
-      const vector<ISymmetry::Config>& m = MatrixIndexMap::theInstance()._Matrices;
-      for ( int a = 0; a < (int) m.size(); a++ )
+   // stabilizer: the (sorted) elements that map the point onto itself
+   // - the elements that map it to the same place form the left coset a*stabilizer, the smallest one is the real one
+   MatrixSymmetryMap( const vector<int>& stabilizer )
+   {
+      int n = MatrixIndexMap::size();
+      _MapToReal.assign( n, -1 );
+      _SymmetricMatrices.resize( n );
+      for ( int a = 0; a < n; a++ ) if ( _MapToReal[a] < 0 )
       {
-         _MapToReal.push_back( a );
-         for ( int i = 0; i < a; i++ )
-            if ( (m[a].m * symmetricalPt).dist2( m[i].m * symmetricalPt ) < 1e-8 )
-            {
-               _MapToReal.back() = i;
-               break;
-            }
+         vector<int> coset;
+         for ( int h : stabilizer )
+            coset.push_back( MatrixIndexMap::mul( a, h ) );
+         sort( coset.begin(), coset.end() );
+         for ( int b : coset )
+         {
+            _MapToReal[b] = coset[0];
+            _SymmetricMatrices[b] = coset;
+         }
       }
-      _SymmetricMatrices.resize( m.size() );
-      for ( int a = 0; a < (int) m.size(); a++ )
-         for ( int b = 0; b < (int) m.size(); b++ )
-            if ( _MapToReal[MatrixIndexMap::indexOf( m[a].m )] == _MapToReal[MatrixIndexMap::indexOf( m[b].m )] )
-               _SymmetricMatrices[a].push_back( b );
-   }
-   bool isReal( const QMtx4x4& m ) const { int index = MatrixIndexMap::indexOf( m ); return _MapToReal[index] == index; }
-   QMtx4x4 toReal( const QMtx4x4& m ) const { return MatrixIndexMap::at( _MapToReal[MatrixIndexMap::indexOf( m )] ); }
-   bool match( const QMtx4x4& a, const QMtx4x4& b ) const { return _MapToReal[MatrixIndexMap::indexOf( a )] == _MapToReal[MatrixIndexMap::indexOf( b )]; }
-   vector<QMtx4x4> symmetricMatrices( const QMtx4x4& m ) const 
-   { 
-      vector<QMtx4x4> ret;
-      for ( int idx : _SymmetricMatrices[MatrixIndexMap::indexOf( m )] ) 
-         ret.push_back( MatrixIndexMap::at( idx ) ); 
-      return ret;
    }
+   bool isReal( int elem ) const { return _MapToReal[elem] == elem; }
+   int toReal( int elem ) const { return _MapToReal[elem]; }
+   bool match( int a, int b ) const { return _MapToReal[a] == _MapToReal[b]; }
+   const vector<int>& symmetricMatrices( int elem ) const { return _SymmetricMatrices[elem]; }
 
    //static MatrixSymmetryMap* symmetryNone()  { static IcoSymmetry ico; static MatrixSymmetryMap s_map( XYZ(7,8,9) ); return &s_map; }
    //static MatrixSymmetryMap* symmetry012()   { static IcoSymmetry ico; static MatrixSymmetryMap s_map( ico[0]+ico[1]+ico[2] ); return &s_map; }
@@ -450,16 +475,25 @@ public:
    //}
    static shared_ptr<MatrixSymmetryMap> symmetryNone() 
    { 
-      return shared_ptr<MatrixSymmetryMap>( new MatrixSymmetryMap(XYZ(7,8,9)) );
+      return forStabilizer( { MatrixIndexMap::IDENTITY } );
    }
 
+   // only a handful of stabilizers exist per symmetry, so the maps are shared by all points of a context
+   static shared_ptr<MatrixSymmetryMap> forStabilizer( const vector<int>& stabilizer )
+   {
+      shared_ptr<MatrixSymmetryMap>& ret = MatrixIndexMap::theInstance()._SymmetryMaps[stabilizer];
+      if ( !ret )
+         ret.reset( new MatrixSymmetryMap( stabilizer ) );
+      return ret;
+   }
 
    static shared_ptr<MatrixSymmetryMap> symmetryFor( const XYZ& p )
    {
-      shared_ptr<MatrixSymmetryMap> ret( new MatrixSymmetryMap( p ) );
-      //if ( !ret->hasSymmetry() )
-      //   return symmetryNone(); // less duplication -- but loading different symmetry is a problem
-      return ret;
+      vector<int> stabilizer;
+      for ( int elem = 0; elem < MatrixIndexMap::size(); elem++ )
+         if ( (MatrixIndexMap::at( elem ) * p).dist2( p ) < 1e-8 )
+            stabilizer.push_back( elem );
+      return forStabilizer( stabilizer );
    }
 
 
@@ -471,32 +505,38 @@ public:
    shared_ptr<MatrixSymmetryMap> _CachedSymmetryNone; 
 };
 
+class ThreadPool;
+
+// called while building a graph: stage, number of items done, total number of items
+typedef function<void( const char* stage, int done, int total )> ProgressCallback;
+
 class Graph
 {
 public:
    class VertexPtr
    {
    public:
-      VertexPtr() : _Index(-1) {}
-      VertexPtr( int idx, const QMtx4x4& mtx ) : _Index(idx), _Mtx(mtx) {}
+      VertexPtr() : _Index(-1), _Elem(MatrixIndexMap::IDENTITY) {}
+      VertexPtr( int idx, int elem ) : _Index(idx), _Elem(elem) {}
       bool isValid() const { return _Index >= 0; }
-      VertexPtr premul( const QMtx4x4& mtx ) const { return VertexPtr( _Index, mtx * _Mtx ); }
-      bool operator==( const VertexPtr& rhs ) const;
-      uint64_t id() const;
+      VertexPtr premul( int elem ) const { return VertexPtr( _Index, MatrixIndexMap::mul( elem, _Elem ) ); }
+      bool operator==( const VertexPtr& rhs ) const { return _Index == rhs._Index && _Elem == rhs._Elem; }
+      uint64_t id() const { return (uint64_t) _Index << 32 | (uint32_t) _Elem; }
+      const Rotation3& mtx() const { return MatrixIndexMap::at( _Elem ); }
 
       int _Index;
-      QMtx4x4 _Mtx;
+      int _Elem; // group element (MatrixIndexMap index)
    };
    class TilePtr
    {
    public:
-      TilePtr() : _Index(-1) {}
-      TilePtr( int idx, const QMtx4x4& mtx ) : _Index(idx), _Mtx(mtx) {}
-      TilePtr premul( const QMtx4x4& mtx ) const { return TilePtr( _Index, mtx * _Mtx ); }
+      TilePtr() : _Index(-1), _Elem(MatrixIndexMap::IDENTITY) {}
+      TilePtr( int idx, int elem ) : _Index(idx), _Elem(elem) {}
+      TilePtr premul( int elem ) const { return TilePtr( _Index, MatrixIndexMap::mul( elem, _Elem ) ); }
       bool isValid() const { return _Index >= 0; }
       //bool operator==( const TilePtr& rhs ) const;
       int _Index;
-      QMtx4x4 _Mtx;
+      int _Elem; // group element (MatrixIndexMap index)
    };
    class Vertex
    {
@@ -504,25 +544,16 @@ public:
       Vertex( int idx ) : _Index(idx) {}
       int _Index;
       bool _IsSymmetrical;
+      shared_ptr<MatrixSymmetryMap> _SymmetryMap; // the copies that are at the same place (if the vertex is on a rotation axis)
       XYZ _Pos;
-      vector<VertexPtr> _Neighbors;
-      vector<TilePtr> _Tiles;
    };
    class Tile
    {
    public:
       int _Index;
       int _Color;
-      vector<VertexPtr> _Vertices;
       //bool _IsSymmetrical = false;
       shared_ptr<MatrixSymmetryMap> _SymmetryMap;
-
-      bool hasVertex( const VertexPtr& a ) const { 
-         for ( const VertexPtr& b : _Vertices )
-            if ( a._Index == b._Index && fuzzyCompare( a._Mtx, b._Mtx ) )
-               return true;
-         return false;
-      }
    };
    struct KeepCloseFar
    {
@@ -541,17 +572,24 @@ public:
       VertexPtr curveCenter;
       VertexPtr b;
    };
+   // what the tiling says about an edge, relative to the identity copy of the vertex it starts at
+   struct EdgeInfo
+   {
+      VertexPtr curveCenter; // invalid if the edge is straight
+      vector<TilePtr> tiles; // the tiles on either side (more than two where copies of a tile meet on a rotation axis)
+   };
 
 public:
    Graph();
+   bool isCurrent() const { return _Group == MatrixIndexMap::current(); } // the handles (and their mtx()) are only valid in _Group
    XYZ posOf( const VertexPtr& vtx ) const;
    //XYZ originalPosOf( const VertexPtr& vtx ) const;
    int idOf( const VertexPtr& vtx ) const;
    VertexPtr fromId( int id ) const;
-   void addNeighbor( const VertexPtr& a, const VertexPtr& b );
    vector<VertexPtr> neighbors( const VertexPtr& vtx ) const;
    vector<VertexPtr> neighbors( const VertexPtr& vtx, int depth ) const;
-   VertexPtr operator[]( int idx ) const { return VertexPtr( idx, QMtx4x4() ); }
+   Span<VertexPtr> neighborhood( int index, int depth ) const;
+   VertexPtr operator[]( int idx ) const { return VertexPtr( idx, MatrixIndexMap::IDENTITY ); }
    vector<int> colorsAt( const VertexPtr& vtx ) const;
    uint32_t colorBits( const VertexPtr& vtx ) const;
    int colorOf( const TilePtr& tile ) const;
@@ -560,25 +598,39 @@ public:
    TilePtr tileWithColor( const VertexPtr& vtx, int color ) const;
    bool mustBeFar( const VertexPtr& a, const VertexPtr& b ) const;
    bool mustBeClose( const VertexPtr& a, const VertexPtr& b ) const;
+   void calcColorTables();
+   void calcEdges();
+   int edgeId( const VertexPtr& a, const VertexPtr& b ) const;
    bool eq( const TilePtr& a, const TilePtr& b ) const;
    bool eq( const VertexPtr& a, const VertexPtr& b ) const;
    vector<VertexPtr> allVertices() const;
    vector<VertexPtr> rawVertices() const;
    vector<TilePtr> rawTiles() const;
    vector<TilePtr> allTiles() const;
-   vector<KeepCloseFar> calcKeepCloseFars() const;
-   vector<LineVertexConstraint> calcLineVertexConstraints() const;
+   vector<KeepCloseFar> calcKeepCloseFars( ThreadPool* pool = nullptr, const ProgressCallback& progress = nullptr ) const;
+   vector<LineVertexConstraint> calcLineVertexConstraints( ThreadPool* pool = nullptr, const ProgressCallback& progress = nullptr ) const;
    vector<pair<VertexPtr,VertexPtr>> calcPerimeter() const;
    VertexPtr calcCurve( const VertexPtr& a, const VertexPtr& b ) const;
    vector<VertexPtr> verticesForTile( const TilePtr& tile ) const;
    
 
 private:
-   void neighbors( const VertexPtr& vtx, int depth, vector<VertexPtr>& v, unordered_set<uint64_t>& st ) const;
+   Csr<VertexPtr> calcNeighborhoods( int depth ) const;
+   VertexPtr findCurveCenter( const VertexPtr& a, const VertexPtr& b ) const;
 
 public:
    vector<Vertex> _Vertices;
    vector<Tile> _Tiles;
+   // adjacency (built by makeGraph), relative to the identity copy of the vertex/tile
+   Csr<VertexPtr> _Neighbors;    // vertex index -> neighboring vertices
+   Csr<TilePtr> _VertexTiles;    // vertex index -> tiles at the vertex
+   Csr<VertexPtr> _TileVertices; // tile index -> vertices around the tile
+   vector<uint32_t> _ColorBits; // idOf(vertex) -> bit flags of the colors at the vertex
+   vector<int> _TileIdAt;       // idOf(vertex)*NUM_COLORS+color -> the tile with that color at the vertex as index+real element*number of tiles, -1 if none
+   vector<EdgeInfo> _Edges;     // edgeId -> curve center and tiles of the edge, parallel to _Neighbors._Items
+   mutable std::map<int, Csr<VertexPtr>> _Neighborhoods; // depth -> neighborhood of every vertex, filled on demand
+   mutable mutex _NeighborhoodsMutex;                    // neighborhood() may be called from several threads
+   shared_ptr<MatrixIndexMap> _Group = MatrixIndexMap::current(); // the symmetry the _Elem of the handles refer to
 };
 
 
@@ -588,20 +640,20 @@ public:
    class VertexPtr
    {
    public:
-      VertexPtr() : _Index(-1) {}
-      VertexPtr( int idx, const QMtx4x4& mtx ) : _Index(idx), _Mtx(mtx) {}
+      VertexPtr() : _Index(-1), _Elem(MatrixIndexMap::IDENTITY) {}
+      VertexPtr( int idx, int elem ) : _Index(idx), _Elem(elem) {}
       bool isValid() const { return _Index >= 0; }
-      //VertexPtr premul( const QMtx4x4& mtx ) const { return VertexPtr( _Index, mtx * _Mtx ); }
-      bool operator==( const VertexPtr& rhs ) const;
+      bool operator==( const VertexPtr& rhs ) const { return _Index == rhs._Index && _Elem == rhs._Elem; }
+      const Rotation3& mtx() const { return MatrixIndexMap::at( _Elem ); }
 
       int _Index;
-      QMtx4x4 _Mtx;
+      int _Elem; // group element (MatrixIndexMap index)
    };
    class Vertex
    {
    public:
       Vertex( int idx ) : _Index(idx) {}
-      VertexPtr toVertexPtr() const { return VertexPtr( _Index, QMtx4x4() ); }
+      VertexPtr toVertexPtr() const { return VertexPtr( _Index, MatrixIndexMap::IDENTITY ); }
       int findNeighborIdx( const VertexPtr& a ) const;
       bool hasNeighbor( const VertexPtr& a ) const;
       void eraseNeighbor( const VertexPtr& a );
@@ -611,6 +663,21 @@ public:
       XYZ _Pos;
       int _Color;
       vector<VertexPtr> _Neighbors;
+
+      // rotation system, kept up to date by the edits of the dual
+      vector<VertexPtr> _Ring;   // neighbors of the identity copy (with the copies of a symmetrical vertex) sorted around it
+      vector<int> _Twins;        // slot of this vertex in the ring of _Ring[k], -1 if there is none
+   };
+   class HalfEdge
+   {
+   public:
+      HalfEdge() : _Index(-1), _Slot(-1), _Elem(MatrixIndexMap::IDENTITY) {}
+      HalfEdge( int idx, int slot, int elem ) : _Index(idx), _Slot(slot), _Elem(elem) {}
+      bool isValid() const { return _Index >= 0 && _Slot >= 0; }
+
+      int _Index; // vertex the edge starts at
+      int _Slot;  // its end in the _Ring of the vertex
+      int _Elem;  // group element of the copy (need not be real)
    };
 
 public:
@@ -624,6 +691,7 @@ public:
    }
    vector<VertexPtr> allVertices() const;
    vector<VertexPtr> baseVertices() const;
+   bool isCurrent() const { return _Group == MatrixIndexMap::current(); } // the handles (and their mtx()) are only valid in _Group
    XYZ posOf( const VertexPtr& vtx ) const;
    void setPos( const VertexPtr& vtx, const XYZ& pos );
    int colorOf( const VertexPtr& vtx ) const;
@@ -637,9 +705,24 @@ public:
    VertexPtr fromId( int id ) const;
    VertexPtr next( const VertexPtr& a, const VertexPtr& b ) const;
    vector<Dual::VertexPtr> polygon( const VertexPtr& a, const VertexPtr& b ) const;
-   VertexPtr premul( const VertexPtr& vtx, const QMtx4x4& mtx ) const;
+   VertexPtr premul( const VertexPtr& vtx, int elem ) const;
    void deleteVertex( int idx );
-   
+   void calcRings(); // after editing _Neighbors directly
+
+   HalfEdge halfEdge( const VertexPtr& a, const VertexPtr& b ) const;
+   VertexPtr originOf( const HalfEdge& h ) const;
+   VertexPtr targetOf( const HalfEdge& h ) const;
+   HalfEdge twin( const HalfEdge& h ) const;
+   HalfEdge next( const HalfEdge& h ) const; // the edge after h around the face polygon() walks
+
+private:
+   void sortRing( int idx );
+   void linkRing( int idx );
+   void updateRings( const set<int>& changed );
+
 public:
    vector<Vertex> _Vertices;
-};
\ No newline at end of file
+   shared_ptr<MatrixIndexMap> _Group = MatrixIndexMap::current(); // the symmetry the _Elem of the handles refer to
+};
+
+shared_ptr<Graph> makeGraph( shared_ptr<const Dual> dual, double radius, ThreadPool* pool = nullptr, const ProgressCallback& progress = nullptr );
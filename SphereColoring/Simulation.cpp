@@ -1,18 +1,27 @@
 #include "Simulation.h"
+#include "SimulationKernels.h"
 #include <set>
 #include <map>
+#include <unordered_map>
+#include <limits>
 
 using namespace std;
 
-void Simulation::init( shared_ptr<Dual> dual, shared_ptr<Graph> graph, double radius )
+namespace
+{
+   bool s_printErrors = false;
+}
+
+void Simulation::init( shared_ptr<Dual> dual, shared_ptr<Graph> graph, double radius, const ProgressCallback& progress )
 {
    _Dual = dual;
    _Graph = graph;
+   SymmetryScope scope( _Graph ? _Graph->_Group : nullptr );
 
    if ( _Graph )
    {
-      _KeepCloseFars = _Graph->calcKeepCloseFars();
-      _LineVertexConstraints = _Graph->calcLineVertexConstraints();
+      _KeepCloseFars = _Graph->calcKeepCloseFars( buildThreadPool(), progress );
+      _LineVertexConstraints = _Graph->calcLineVertexConstraints( buildThreadPool(), progress );
    }
    
    //for ( const Graph::KeepCloseFar& kcf : _KeepCloseFars )
@@ -21,6 +30,8 @@ void Simulation::init( shared_ptr<Dual> dual, shared_ptr<Graph> graph, double ra
 
    _Radius = radius;
    normalizeVertices();
+   compileConstraints();
+   _Monitor.reset();
 }
 
 
@@ -35,116 +46,451 @@ void Simulation::normalizeVertices()
       vtx._Pos = vtx._Pos.normalized() * _Radius;
 }
 
+void Simulation::compileConstraints()
+{
+   _CompiledKeepCloseFars = CompiledKeepCloseFars();
+   _CompiledStraightLines = CompiledLineVertexConstraints();
+   _CompiledCurvedLines = CompiledLineVertexConstraints();
+   _Rotations.clear();
+   _InvRotations.clear();
+   _SlotVertex.clear();
+   _SlotElem.clear();
+   if ( !_Graph )
+      return;
+
+   for ( const ISymmetry::Config& config : MatrixIndexMap::theInstance()._Matrices )
+   {
+      _Rotations.push_back( config.m );
+      _InvRotations.push_back( config.m.inverted() );
+   }
+
+   unordered_map<int64_t, int> slotIndex;
+   auto slotOf = [&]( int vertex, int elem ) {
+      int64_t key = (int64_t) elem * _Graph->_Vertices.size() + vertex;
+      auto it = slotIndex.find( key );
+      if ( it != slotIndex.end() )
+         return it->second;
+      _SlotVertex.push_back( vertex );
+      _SlotElem.push_back( elem );
+      return slotIndex[key] = (int) _SlotVertex.size() - 1;
+   };
+
+   for ( const Graph::KeepCloseFar& kcf : _KeepCloseFars )
+   {
+      CompiledKeepCloseFars& c = _CompiledKeepCloseFars;
+      c.a.push_back( kcf.a._Index );
+      c.b.push_back( kcf.b._Index );
+      c.aElem.push_back( kcf.a._Elem );
+      c.bElem.push_back( kcf.b._Elem );
+      c.aSlot.push_back( slotOf( c.a.back(), c.aElem.back() ) );
+      c.bSlot.push_back( slotOf( c.b.back(), c.bElem.back() ) );
+      c.type.push_back( ( kcf.keepClose ? CompiledKeepCloseFars::KEEP_CLOSE : 0 ) | ( kcf.keepFar ? CompiledKeepCloseFars::KEEP_FAR : 0 ) );
+   }
+
+   for ( const Graph::LineVertexConstraint& lvc : _LineVertexConstraints )
+   {
+      CompiledLineVertexConstraints& c = lvc.curveCenter.isValid() ? _CompiledCurvedLines : _CompiledStraightLines;
+      c.a0.push_back( lvc.a0._Index );
+      c.a1.push_back( lvc.a1._Index );
+      c.center.push_back( lvc.curveCenter._Index );
+      c.b.push_back( lvc.b._Index );
+      c.a0Elem.push_back( lvc.a0._Elem );
+      c.a1Elem.push_back( lvc.a1._Elem );
+      c.centerElem.push_back( lvc.curveCenter.isValid() ? lvc.curveCenter._Elem : 0 );
+      c.bElem.push_back( lvc.b._Elem );
+   }
+
+   int numSlots = (int) _SlotVertex.size();
+   _SlotX.resize( numSlots );
+   _SlotY.resize( numSlots );
+   _SlotZ.resize( numSlots );
+   _BroadPhasePos.clear(); // forces a rebuild of the active lists
+   _ActiveSetPos.clear();
+   _Lbfgs = LbfgsState();
+   _PbdColoring = ConstraintColoring();
+   _PbdLastPos.clear();
+}
+
+void Simulation::setNumThreads( int numThreads )
+{
+   numThreads = max( 1, numThreads );
+   if ( numThreads == numThreadsInUse() )
+      return;
+   _ThreadPool.reset( numThreads > 1 ? new ThreadPool( numThreads ) : nullptr );
+}
+
+// the build runs once per graph, so it can use every core without slowing down the steps
+void Simulation::setNumBuildThreads( int numThreads )
+{
+   _BuildThreadPool.reset( numThreads > 1 ? new ThreadPool( numThreads ) : nullptr );
+}
+
+int Simulation::numThreadsInUse() const
+{
+   return _ThreadPool ? _ThreadPool->size() : 1;
+}
+
+void Simulation::runParallel( const function<void(int)>& task )
+{
+   if ( _ThreadPool )
+      _ThreadPool->run( task );
+   else
+      task( 0 );
+}
+
+void Simulation::rangeOf( int n, int threadIdx, int& begin, int& end ) const
+{
+   if ( _ThreadPool )
+   {
+      _ThreadPool->rangeOf( n, threadIdx, begin, end );
+      return;
+   }
+   begin = 0;
+   end = n;
+}
+
+void Simulation::gatherPositions()
+{
+   int numVertices = (int) _Graph->_Vertices.size();
+   _Pos.resize( numVertices );
+   _ThreadStates.resize( numThreadsInUse() );
+   runParallel( [&]( int threadIdx ) {
+      int begin, end;
+      rangeOf( numVertices, threadIdx, begin, end );
+      for ( int i = begin; i < end; i++ )
+         _Pos[i] = _Graph->_Vertices[i]._Pos;
+   } );
+}
+
+// the distance of a keep-close/keep-far changes by at most the sum of its vertices' displacements, so a constraint with
+// slack s (how far its distance can change before it's violated) can be left out until one of its vertices moved s/2
+// - rigid edges are never left out
+void Simulation::updateActiveKeepCloseFars()
+{
+   int numVertices = (int) _Pos.size();
+   if ( (int) _ActiveSetPos.size() == numVertices )
+   {
+      runParallel( [&]( int threadIdx ) {
+         ThreadState& state = _ThreadStates[threadIdx];
+         state.needsActiveSet = false;
+         int begin, end;
+         rangeOf( numVertices, threadIdx, begin, end );
+         for ( int i = begin; i < end && !state.needsActiveSet; i++ )
+            state.needsActiveSet = _Pos[i].dist( _ActiveSetPos[i] ) * 2 >= _SleepingSlack[i];
+      } );
+      bool needsActiveSet = false;
+      for ( const ThreadState& state : _ThreadStates )
+         needsActiveSet |= state.needsActiveSet;
+      if ( !needsActiveSet )
+         return;
+   }
+
+   const CompiledKeepCloseFars& kcfs = _CompiledKeepCloseFars;
+   _ActiveSetPos = _Pos;
+   _ActiveKeepCloseFars.clear();
+   _SleepingSlack.assign( numVertices, numeric_limits<double>::infinity() );
+   vector<bool> isSlotActive( _SlotVertex.size() );
+   for ( int k = 0; k < kcfs.size(); k++ )
+   {
+      double dist = (_Rotations[kcfs.bElem[k]] * _Pos[kcfs.b[k]]).dist( _Rotations[kcfs.aElem[k]] * _Pos[kcfs.a[k]] );
+      double slack = 0;
+      if ( kcfs.type[k] == CompiledKeepCloseFars::KEEP_CLOSE ) slack = (1-_Padding) - dist;
+      if ( kcfs.type[k] == CompiledKeepCloseFars::KEEP_FAR )   slack = dist - (1+_Padding);
+      if ( _UseActiveSet && slack >= _ActiveSetMargin )
+      {
+         _SleepingSlack[kcfs.a[k]] = min( _SleepingSlack[kcfs.a[k]], slack );
+         _SleepingSlack[kcfs.b[k]] = min( _SleepingSlack[kcfs.b[k]], slack );
+         continue;
+      }
+      _ActiveKeepCloseFars.append( kcfs, k );
+      isSlotActive[kcfs.aSlot[k]] = true;
+      isSlotActive[kcfs.bSlot[k]] = true;
+   }
+   _KeepCloseFarCoef.resize( _ActiveKeepCloseFars.size() );
+   _ActiveSlots.clear();
+   for ( int s = 0; s < (int) isSlotActive.size(); s++ )
+      if ( isSlotActive[s] )
+         _ActiveSlots.push_back( s );
+}
+
+// world positions of the slots of the active keep-close/keep-far constraints
+void Simulation::updateSlots()
+{
+   int numSlots = (int) _ActiveSlots.size();
+   runParallel( [&]( int threadIdx ) {
+      int begin, end;
+      rangeOf( numSlots, threadIdx, begin, end );
+      for ( int i = begin; i < end; i++ )
+      {
+         int s = _ActiveSlots[i];
+         XYZ p = _Rotations[_SlotElem[s]] * _Pos[_SlotVertex[s]];
+         _SlotX[s] = p.x;
+         _SlotY[s] = p.y;
+         _SlotZ[s] = p.z;
+      }
+   } );
+}
+
 double Simulation::step( double& paddingError )
-{   
+{
    if ( !_Graph )
       return -1;
-   static bool s_printErrors = false;
-   bool printErrors = s_printErrors && _PaddingError == 0;
+
+   if ( _Solver == LBFGS )
+      return stepLbfgs( paddingError );
+   if ( _Solver == LEVENBERG_MARQUARDT )
+      return stepLevenbergMarquardt( paddingError );
+   if ( _Solver == POSITION_BASED )
+      return stepPositionBased( paddingError );
+
+   int numThreads = numThreadsInUse();
+   int numVertices = (int) _Graph->_Vertices.size();
+
+   gatherPositions();
+   updateBroadPhase();
+   updateActiveKeepCloseFars();
+   updateSlots();
+
+   // every thread takes a share of each constraint list and accumulates into its own velocities/errors
+   runParallel( [&]( int threadIdx ) {
+      ThreadState& state = _ThreadStates[threadIdx];
+      state.vel.assign( numVertices, XYZ() );
+      state.totalError = 0;
+      state.paddingError = 0;
+
+      int begin, end;
+      rangeOf( _ActiveKeepCloseFars.size(), threadIdx, begin, end );
+      stepKeepCloseFars( begin, end, state );
+      rangeOf( (int) _ActiveStraightLines.size(), threadIdx, begin, end );
+      stepStraightLines( begin, end, state );
+      rangeOf( (int) _ActiveCurvedLines.size(), threadIdx, begin, end );
+      stepCurvedLines( begin, end, state );
+   } );
+
+   // apply velocities
+   runParallel( [&]( int threadIdx ) {
+      int begin, end;
+      rangeOf( numVertices, threadIdx, begin, end );
+      for ( int i = begin; i < end; i++ ) if ( !_Graph->_Vertices[i]._IsSymmetrical )
+      {
+         XYZ vel = _ThreadStates[0].vel[i];
+         for ( int t = 1; t < numThreads; t++ )
+            vel += _ThreadStates[t].vel[i];
+         _Graph->_Vertices[i]._Pos = (_Pos[i] + vel).normalized() * _Radius;
+      }
+   } );
+
    double totalError = 0;
    paddingError = 0;
-   vector<XYZ> vel( _Graph->_Vertices.size() );
+   for ( const ThreadState& state : _ThreadStates )
+   {
+      totalError += state.totalError;
+      paddingError += state.paddingError;
+   }
+   return totalError;
+}
 
-   for ( const Graph::KeepCloseFar& kcf : _KeepCloseFars )
+namespace
+{
+   // the line-vertex constraints only push when b is within 1+pad of the arc from a0 to a1,
+   // so they can be skipped while b is far from the ball bounding the arc
+   // - a0, a1 are on a circle centered on the origin, the arc is the shorter one (at most 180 degrees)
+   double distToArcBound( const XYZ& a0, const XYZ& a1, const XYZ& b )
    {
-      XYZ a = _Graph->posOf( kcf.a );
-      XYZ b = _Graph->posOf( kcf.b );
-      double dist = a.dist( b );
+      return b.dist( (a0+a1)/2 ) - a0.dist( a1 )/2;
+   }
+
+   // a vertex moving by d moves a bounding ball by at most BROAD_PHASE_SPEED*d, as long as the
+   // arms of the curved constraints (curve center to a0/a1) are at least MIN_CURVE_ARM long
+   const double BROAD_PHASE_SPEED = 20;
+   const double MIN_CURVE_ARM = .6;
+}
+
+// rebuilds the active line-vertex constraint lists when a vertex may have moved far enough to bring a skipped constraint into range
+void Simulation::updateBroadPhase()
+{
+   int numVertices = (int) _Pos.size();
+   double maxDisplacement = 0;
+   if ( (int) _BroadPhasePos.size() == numVertices )
+   {
+      runParallel( [&]( int threadIdx ) {
+         ThreadState& state = _ThreadStates[threadIdx];
+         state.maxDisplacement = 0;
+         int begin, end;
+         rangeOf( numVertices, threadIdx, begin, end );
+         for ( int i = begin; i < end; i++ )
+            state.maxDisplacement = max( state.maxDisplacement, _Pos[i].dist( _BroadPhasePos[i] ) );
+      } );
+      for ( const ThreadState& state : _ThreadStates )
+         maxDisplacement = max( maxDisplacement, state.maxDisplacement );
+   }
+
+   _StepsSinceBroadPhase++;
+   bool isValid = (int) _BroadPhasePos.size() == numVertices && _StepsSinceBroadPhase < _BroadPhaseInterval;
+   if ( _UseBroadPhase && isValid && maxDisplacement * BROAD_PHASE_SPEED < _BroadPhaseMargin )
+      return;
+   if ( !_UseBroadPhase && (int) _ActiveStraightLines.size() == _CompiledStraightLines.size() && (int) _ActiveCurvedLines.size() == _CompiledCurvedLines.size() )
+      return;
+
+   _BroadPhasePos = _Pos;
+   _StepsSinceBroadPhase = 0;
+   _NumBroadPhaseBuilds++;
+   double maxGap = 1 + _Padding + _BroadPhaseMargin;
 
-      double pad = kcf.keepClose && kcf.keepFar ? 0 : _Padding;
-      if ( kcf.keepClose && dist >= 1.-pad )
+   runParallel( [&]( int threadIdx ) {
+      ThreadState& state = _ThreadStates[threadIdx];
+      state.activeStraightLines.clear();
+      state.activeCurvedLines.clear();
+      auto posOf = [&]( int vertex, int elem ) { return _Rotations[elem] * _Pos[vertex]; };
+
+      const CompiledLineVertexConstraints& straights = _CompiledStraightLines;
+      int begin, end;
+      rangeOf( straights.size(), threadIdx, begin, end );
+      for ( int k = begin; k < end; k++ )
       {
-         vel[kcf.a._Index] += (kcf.a._Mtx.inverted() * (b-a)) * (dist-(1-pad)) * .03;
-         vel[kcf.b._Index] += (kcf.b._Mtx.inverted() * (a-b)) * (dist-(1-pad)) * .03;
-         totalError += max(0.,dist-1);
-         paddingError += dist-(1-pad);
-         if ( printErrors && !kcf.keepFar && dist-1 > 0 ) qDebug() << "keep close" << kcf.a._Index << kcf.b._Index << dist-1;
+         if ( _UseBroadPhase && distToArcBound( posOf( straights.a0[k], straights.a0Elem[k] ), posOf( straights.a1[k], straights.a1Elem[k] ), posOf( straights.b[k], straights.bElem[k] ) ) >= maxGap )
+            continue;
+         state.activeStraightLines.push_back( k );
       }
-      if ( kcf.keepFar && dist <= 1.+pad )
+
+      const CompiledLineVertexConstraints& curves = _CompiledCurvedLines;
+      rangeOf( curves.size(), threadIdx, begin, end );
+      for ( int k = begin; k < end; k++ )
       {
-         vel[kcf.a._Index] += (kcf.a._Mtx.inverted() * (a-b).normalized()) * ((1+pad)-dist) * .03;
-         vel[kcf.b._Index] += (kcf.b._Mtx.inverted() * (b-a).normalized()) * ((1+pad)-dist) * .03;
-         totalError += max(0.,1-dist);
-         paddingError += (1+pad)-dist;
-         if ( printErrors && !kcf.keepClose && 1-dist > 0 ) qDebug() << "keep far" << kcf.a._Index << kcf.b._Index << 1-dist;
+         if ( _UseBroadPhase )
+         {
+            XYZ center = posOf( curves.center[k], curves.centerElem[k] );
+            XYZ a0 = posOf( curves.a0[k], curves.a0Elem[k] ) - center;
+            XYZ a1 = posOf( curves.a1[k], curves.a1Elem[k] ) - center;
+            XYZ b = posOf( curves.b[k], curves.bElem[k] ) - center;
+            if ( a0.len() >= MIN_CURVE_ARM && a1.len() >= MIN_CURVE_ARM && distToArcBound( a0.normalized(), a1.normalized(), b ) >= maxGap )
+               continue;
+         }
+         state.activeCurvedLines.push_back( k );
       }
+   } );
+
+   // concatenate in thread order so the lists stay sorted
+   _ActiveStraightLines.clear();
+   _ActiveCurvedLines.clear();
+   for ( const ThreadState& state : _ThreadStates )
+   {
+      _ActiveStraightLines.insert( _ActiveStraightLines.end(), state.activeStraightLines.begin(), state.activeStraightLines.end() );
+      _ActiveCurvedLines.insert( _ActiveCurvedLines.end(), state.activeCurvedLines.begin(), state.activeCurvedLines.end() );
    }
-   //static bool s_dolvc = true;
-   for ( const Graph::LineVertexConstraint& lvc : _LineVertexConstraints )  if ( !lvc.curveCenter.isValid() )
+}
+
+// keep-close/keep-far: the kernel evaluates the constraints on the world positions of their slots,
+// then the pushes of the violated ones are rotated back into the vertices' frames
+void Simulation::stepKeepCloseFars( int begin, int end, ThreadState& state )
+{
+   const CompiledKeepCloseFars& kcfs = _ActiveKeepCloseFars;
+   KeepCloseFarKernelData kernelData = { _SlotX.data(), _SlotY.data(), _SlotZ.data(), kcfs.aSlot.data(), kcfs.bSlot.data(), kcfs.type.data(), _Padding };
+   KeepCloseFarKernel kernel = _UseSimd ? bestKeepCloseFarKernel() : keepCloseFarKernelScalar;
+   kernel( kernelData, begin, end, _KeepCloseFarCoef.data(), state.totalError, state.paddingError );
+
+   bool printErrors = s_printErrors && _PaddingError == 0;
+   XYZ* vel = state.vel.data();
+   for ( int k = begin; k < end; k++ ) if ( _KeepCloseFarCoef[k] != 0 )
    {
+      int sa = kcfs.aSlot[k];
+      int sb = kcfs.bSlot[k];
+      XYZ ab( _SlotX[sb] - _SlotX[sa], _SlotY[sb] - _SlotY[sa], _SlotZ[sb] - _SlotZ[sa] );
+      vel[kcfs.a[k]] += _InvRotations[kcfs.aElem[k]] * ab * _KeepCloseFarCoef[k];
+      vel[kcfs.b[k]] -= _InvRotations[kcfs.bElem[k]] * ab * _KeepCloseFarCoef[k];
+      if ( printErrors )
+      {
+         double dist = ab.len();
+         if ( kcfs.type[k] == CompiledKeepCloseFars::KEEP_CLOSE && dist-1 > 0 ) qDebug() << "keep close" << kcfs.a[k] << kcfs.b[k] << dist-1;
+         if ( kcfs.type[k] == CompiledKeepCloseFars::KEEP_FAR   && 1-dist > 0 ) qDebug() << "keep far" << kcfs.a[k] << kcfs.b[k] << 1-dist;
+      }
+   }
+}
+
+// straight lines: the curve is a circle with radius=_Radius, centered at the origin
+void Simulation::stepStraightLines( int begin, int end, ThreadState& state )
+{
+   const CompiledLineVertexConstraints& straights = _CompiledStraightLines;
+   const Rotation3* rot = _Rotations.data();
+   const Rotation3* invRot = _InvRotations.data();
+   const XYZ* pos = _Pos.data();
+   XYZ* vel = state.vel.data();
+   bool printErrors = s_printErrors && _PaddingError == 0;
+
+   for ( int i = begin; i < end; i++ )
+   {
+      int k = _ActiveStraightLines[i];
       double pad = _Padding;
+      double R = _Radius;
 
-      // if the curveCenter is valid, then the curve is a circle with radius=1, centered at lvc.curveCenter
-      // otherwise,                        the curve is a circle with radius=_Radius, centered at the origin
-      XYZ center = lvc.curveCenter.isValid() ? _Graph->posOf( lvc.curveCenter ) : XYZ();
-      XYZ b = _Graph->posOf( lvc.b ) - center;
-      XYZ a0 = _Graph->posOf( lvc.a0 ) - center;
-      XYZ a1 = _Graph->posOf( lvc.a1 ) - center;
-      double R = lvc.curveCenter.isValid() ? 1 : _Radius;
+      XYZ b = rot[straights.bElem[k]] * pos[straights.b[k]];
+      XYZ a0 = rot[straights.a0Elem[k]] * pos[straights.a0[k]];
+      XYZ a1 = rot[straights.a1Elem[k]] * pos[straights.a1[k]];
       double dot = a0 * a1;
       // b = x * a0 + y * a1 + z * (a0^a1)   // solve for x/y/z
       double x = (b*a0 * R*R - b*a1 * dot) / (R*R*R*R - dot*dot);
       double y = (b*a1 * R*R - b*a0 * dot) / (R*R*R*R - dot*dot);
       if ( x < 0 || x > 1 || y < 0 || y > 1 )
          continue; // b doesn't lie between a0, a1  (so the distance checks on the endpoints are sufficient)
-      XYZ q = (a0*x + a1*y).normalized() * R; // project the point to the circle 
+      XYZ q = (a0*x + a1*y).normalized() * R; // project the point to the circle
       double dist = q.dist( b );
-      if ( dist >= 1+pad ) 
+      if ( dist >= 1+pad )
          continue;
-      
-      XYZ qb = (q-b).normalized();
-      vel[lvc.a0._Index] += (lvc.a0._Mtx.inverted() * qb) * ((1+pad)-dist) *  .005;
-      vel[lvc.a1._Index] += (lvc.a1._Mtx.inverted() * qb) * ((1+pad)-dist) *  .005;
-      vel[lvc.b._Index]  += (lvc.b._Mtx.inverted()  * qb) * ((1+pad)-dist) * -.01;
-      totalError += max(0.,1-dist);
-      paddingError += (1+pad)-dist;
-      if ( printErrors && 1-dist > 0 ) qDebug() << "straight line to vertex" << lvc.a0._Index << lvc.a1._Index << lvc.b._Index << 1-dist;
+
+      XYZ qb = dist > 0 ? (q-b) / dist : XYZ(); // b on the line still counts as an error, but has no direction to be pushed in
+      vel[straights.a0[k]] += (invRot[straights.a0Elem[k]] * qb) * ((1+pad)-dist) *  .005;
+      vel[straights.a1[k]] += (invRot[straights.a1Elem[k]] * qb) * ((1+pad)-dist) *  .005;
+      vel[straights.b[k]]  += (invRot[straights.bElem[k]]  * qb) * ((1+pad)-dist) * -.01;
+      state.totalError += max(0.,1-dist);
+      state.paddingError += (1+pad)-dist;
+      if ( printErrors && 1-dist > 0 ) qDebug() << "straight line to vertex" << straights.a0[k] << straights.a1[k] << straights.b[k] << 1-dist;
    }
-   for ( const Graph::LineVertexConstraint& lvc : _LineVertexConstraints )  if ( lvc.curveCenter.isValid() )
+}
+
+// curved lines: the curve is a circle with radius=1, centered at the curve center
+void Simulation::stepCurvedLines( int begin, int end, ThreadState& state )
+{
+   const CompiledLineVertexConstraints& curves = _CompiledCurvedLines;
+   const Rotation3* rot = _Rotations.data();
+   const Rotation3* invRot = _InvRotations.data();
+   const XYZ* pos = _Pos.data();
+   XYZ* vel = state.vel.data();
+   bool printErrors = s_printErrors && _PaddingError == 0;
+
+   for ( int i = begin; i < end; i++ )
    {
+      int k = _ActiveCurvedLines[i];
       double pad = _Padding;
-      
-      // if the curveCenter is valid, then the curve is a circle with radius=1, centered at lvc.curveCenter
-      // otherwise,                        the curve is a circle with radius=_Radius, centered at the origin
-      XYZ center = lvc.curveCenter.isValid() ? _Graph->posOf( lvc.curveCenter ) : XYZ();
-      XYZ b = _Graph->posOf( lvc.b ) - center;
+      double R = 1;
+
+      XYZ center = rot[curves.centerElem[k]] * pos[curves.center[k]];
+      XYZ b = rot[curves.bElem[k]] * pos[curves.b[k]] - center;
       if ( b.len2() >= (2+pad)*(2+pad) )
          continue;
-      XYZ a0 = (_Graph->posOf( lvc.a0 ) - center).normalized();
-      XYZ a1 = (_Graph->posOf( lvc.a1 ) - center).normalized();
-      double R = lvc.curveCenter.isValid() ? 1 : _Radius;
+      XYZ a0 = (rot[curves.a0Elem[k]] * pos[curves.a0[k]] - center).normalized();
+      XYZ a1 = (rot[curves.a1Elem[k]] * pos[curves.a1[k]] - center).normalized();
       double dot = a0 * a1;
       // b = x * a0 + y * a1 + z * (a0^a1)   // solve for x/y/z
       double x = (b*a0 * 1 - b*a1 * dot) / (1 - dot*dot);
       double y = (b*a1 * 1 - b*a0 * dot) / (1 - dot*dot);
       if ( x < 0 || y < 0 )
          continue; // b doesn't lie between a0, a1  (so the distance checks on the endpoints are sufficient)
-      XYZ q = (a0*x + a1*y).normalized() * R; // project the point to the circle 
+      XYZ q = (a0*x + a1*y).normalized() * R; // project the point to the circle
       double dist = q.dist( b );
-      if ( dist >= 1+pad ) 
+      if ( dist >= 1+pad )
          continue;
       if ( isnan(dist) )
-         qDebug() << lvc.curveCenter._Index << lvc.a0._Index << lvc.a1._Index << lvc.b._Index << dist;
-
-      XYZ qb = (q-b).normalized();
-      vel[lvc.curveCenter._Index]  += (lvc.curveCenter._Mtx.inverted() * qb) * ((1+pad)-dist) *  .00003;
-      vel[lvc.a0._Index]           += (lvc.a0._Mtx.inverted()          * qb) * ((1+pad)-dist) *  .00003;
-      vel[lvc.a1._Index]           += (lvc.a1._Mtx.inverted()          * qb) * ((1+pad)-dist) *  .00003;
-      vel[lvc.b._Index]            += (lvc.b._Mtx.inverted()           * qb) * ((1+pad)-dist) * -.00009;
-      totalError += max(0.,1-dist);
-      paddingError += (1+pad)-dist;
-      if ( printErrors && 1-dist > 0 ) qDebug() << "curved line to vertex" << lvc.a0._Index << lvc.a1._Index << lvc.curveCenter._Index << lvc.b._Index << 1-dist;
-   }
+         qDebug() << curves.center[k] << curves.a0[k] << curves.a1[k] << curves.b[k] << dist;
 
-
-   // apply velocities
-   for ( int i = 0; i < (int)vel.size(); i++ ) if ( !_Graph->_Vertices[i]._IsSymmetrical )
-   {
-      _Graph->_Vertices[i]._Pos += vel[i];
+      XYZ qb = dist > 0 ? (q-b) / dist : XYZ();
+      vel[curves.center[k]] += (invRot[curves.centerElem[k]] * qb) * ((1+pad)-dist) *  .00003;
+      vel[curves.a0[k]]     += (invRot[curves.a0Elem[k]]     * qb) * ((1+pad)-dist) *  .00003;
+      vel[curves.a1[k]]     += (invRot[curves.a1Elem[k]]     * qb) * ((1+pad)-dist) *  .00003;
+      vel[curves.b[k]]      += (invRot[curves.bElem[k]]      * qb) * ((1+pad)-dist) * -.00009;
+      state.totalError += max(0.,1-dist);
+      state.paddingError += (1+pad)-dist;
+      if ( printErrors && 1-dist > 0 ) qDebug() << "curved line to vertex" << curves.a0[k] << curves.a1[k] << curves.center[k] << curves.b[k] << 1-dist;
    }
-   normalizeVertices();
-
-   return totalError;
 }
 
 double Simulation::step( int numSteps )
@@ -166,5 +512,633 @@ double Simulation::step( int numSteps )
 
 
    _PaddingError = totalPaddingError / numSteps;
+   _Monitor.addWindow( tot / numSteps, _PaddingError, numSteps );
    return tot / numSteps;
-}
\ No newline at end of file
+}
+namespace
+{
+   double dot( const vector<XYZ>& a, const vector<XYZ>& b )
+   {
+      double sum = 0;
+      for ( int i = 0; i < (int) a.size(); i++ )
+         sum += a[i] * b[i];
+      return sum;
+   }
+
+   // d/dv of v.normalized(), applied to g
+   XYZ normalizedDerivative( const XYZ& v, const XYZ& g )
+   {
+      double len = v.len();
+      XYZ n = v / len;
+      return (g - n * (n*g)) / len;
+   }
+}
+
+// the constraints as an energy: every violated constraint adds .5*r^2, where the residual r is how far it is from
+// being satisfied with padding, returns the energy and its gradient w.r.t. the vertex positions (projected onto the sphere)
+// - the residuals are left in the thread states
+double Simulation::evalEnergy( vector<XYZ>& grad, double& totalError, double& paddingError )
+{
+   int numVertices = (int) _Pos.size();
+   updateBroadPhase();
+
+   runParallel( [&]( int threadIdx ) {
+      ThreadState& state = _ThreadStates[threadIdx];
+      state.vel.assign( numVertices, XYZ() );
+      state.totalError = 0;
+      state.paddingError = 0;
+      state.energy = 0;
+      collectResiduals( threadIdx, state.residuals );
+      for ( const Residual& res : state.residuals )
+      {
+         for ( int j = 0; j < res.numVertices; j++ )
+            state.vel[res.vertex[j]] += res.d[j] * res.r;
+         state.energy += .5 * res.r * res.r;
+         state.totalError += res.error;
+         state.paddingError += abs( res.r );
+      }
+   } );
+
+   grad.resize( numVertices );
+   runParallel( [&]( int threadIdx ) {
+      int begin, end;
+      rangeOf( numVertices, threadIdx, begin, end );
+      for ( int i = begin; i < end; i++ )
+      {
+         if ( _Graph->_Vertices[i]._IsSymmetrical )
+         {
+            grad[i] = XYZ();
+            continue;
+         }
+         XYZ g = _ThreadStates[0].vel[i];
+         for ( int t = 1; t < (int) _ThreadStates.size(); t++ )
+            g += _ThreadStates[t].vel[i];
+         XYZ n = _Pos[i].normalized();
+         grad[i] = g - n * (n*g);
+      }
+   } );
+
+   double energy = 0;
+   totalError = 0;
+   paddingError = 0;
+   for ( const ThreadState& state : _ThreadStates )
+   {
+      energy += state.energy;
+      totalError += state.totalError;
+      paddingError += state.paddingError;
+   }
+   return energy;
+}
+
+// residuals of this thread's share of the violated (or rigid) constraints
+void Simulation::collectResiduals( int threadIdx, vector<Residual>& residuals ) const
+{
+   residuals.clear();
+   Residual res;
+   int begin, end;
+   rangeOf( _CompiledKeepCloseFars.size(), threadIdx, begin, end );
+   for ( int k = begin; k < end; k++ )
+      if ( keepCloseFarResidual( k, res ) )
+         residuals.push_back( res );
+   rangeOf( (int) _ActiveStraightLines.size(), threadIdx, begin, end );
+   for ( int i = begin; i < end; i++ )
+      if ( straightLineResidual( _ActiveStraightLines[i], res ) )
+         residuals.push_back( res );
+   rangeOf( (int) _ActiveCurvedLines.size(), threadIdx, begin, end );
+   for ( int i = begin; i < end; i++ )
+      if ( curvedLineResidual( _ActiveCurvedLines[i], res ) )
+         residuals.push_back( res );
+}
+
+// r = dist-(1-pad) for a violated keep close, dist-(1+pad) for a violated keep far, dist-1 for a rigid edge
+bool Simulation::keepCloseFarResidual( int k, Residual& res ) const
+{
+   const CompiledKeepCloseFars& kcfs = _CompiledKeepCloseFars;
+   XYZ ab = _Rotations[kcfs.bElem[k]] * _Pos[kcfs.b[k]] - _Rotations[kcfs.aElem[k]] * _Pos[kcfs.a[k]];
+   double dist = ab.len();
+
+   bool keepClose = kcfs.type[k] & CompiledKeepCloseFars::KEEP_CLOSE;
+   bool keepFar = kcfs.type[k] & CompiledKeepCloseFars::KEEP_FAR;
+   double pad = keepClose && keepFar ? 0 : _Padding;
+   if ( keepClose && dist >= 1-pad )
+   {
+      res.r = dist-(1-pad);
+      res.error = max(0.,dist-1);
+   }
+   else if ( keepFar && dist <= 1+pad )
+   {
+      res.r = dist-(1+pad);
+      res.error = max(0.,1-dist);
+   }
+   else
+      return false;
+
+   XYZ n = ab / dist;
+   res.numVertices = 2;
+   res.vertex[0] = kcfs.a[k];
+   res.vertex[1] = kcfs.b[k];
+   res.d[0] = _InvRotations[kcfs.aElem[k]] * -n;
+   res.d[1] = _InvRotations[kcfs.bElem[k]] * n;
+   return true;
+}
+
+// r = (1+pad)-dist(q,b), q is the point of the arc nearest to b, q = R * (x*a0 + y*a1).normalized()
+// - since q is the nearest point, x/y can be treated as constants when differentiating dist(q,b)
+bool Simulation::straightLineResidual( int k, Residual& res ) const
+{
+   const CompiledLineVertexConstraints& straights = _CompiledStraightLines;
+   double pad = _Padding;
+   double R = _Radius;
+
+   XYZ b = _Rotations[straights.bElem[k]] * _Pos[straights.b[k]];
+   XYZ a0 = _Rotations[straights.a0Elem[k]] * _Pos[straights.a0[k]];
+   XYZ a1 = _Rotations[straights.a1Elem[k]] * _Pos[straights.a1[k]];
+   double dot = a0 * a1;
+   double x = (b*a0 * R*R - b*a1 * dot) / (R*R*R*R - dot*dot);
+   double y = (b*a1 * R*R - b*a0 * dot) / (R*R*R*R - dot*dot);
+   if ( x < 0 || x > 1 || y < 0 || y > 1 )
+      return false;
+   XYZ p = a0*x + a1*y;
+   XYZ q = p.normalized() * R;
+   double dist = q.dist( b );
+   if ( dist >= 1+pad )
+      return false;
+
+   XYZ g = dist > 0 ? (q-b) / dist : XYZ(); // d(dist)/dq, none if b is on the line
+   XYZ gp = normalizedDerivative( p, g ) * R;
+   res.r = (1+pad)-dist;
+   res.error = max(0.,1-dist);
+   res.numVertices = 3;
+   res.vertex[0] = straights.a0[k];
+   res.vertex[1] = straights.a1[k];
+   res.vertex[2] = straights.b[k];
+   res.d[0] = _InvRotations[straights.a0Elem[k]] * (gp * -x);
+   res.d[1] = _InvRotations[straights.a1Elem[k]] * (gp * -y);
+   res.d[2] = _InvRotations[straights.bElem[k]]  * g;
+   return true;
+}
+
+// r = (1+pad)-dist(q,b), q is the point of the arc nearest to b, q = center + (x*u0 + y*u1).normalized() where ui = (ai-center).normalized()
+bool Simulation::curvedLineResidual( int k, Residual& res ) const
+{
+   const CompiledLineVertexConstraints& curves = _CompiledCurvedLines;
+   double pad = _Padding;
+
+   XYZ center = _Rotations[curves.centerElem[k]] * _Pos[curves.center[k]];
+   XYZ b = _Rotations[curves.bElem[k]] * _Pos[curves.b[k]] - center;
+   if ( b.len2() >= (2+pad)*(2+pad) )
+      return false;
+   XYZ a0 = _Rotations[curves.a0Elem[k]] * _Pos[curves.a0[k]] - center;
+   XYZ a1 = _Rotations[curves.a1Elem[k]] * _Pos[curves.a1[k]] - center;
+   XYZ u0 = a0.normalized();
+   XYZ u1 = a1.normalized();
+   double dot = u0 * u1;
+   double x = (b*u0 - b*u1 * dot) / (1 - dot*dot);
+   double y = (b*u1 - b*u0 * dot) / (1 - dot*dot);
+   if ( x < 0 || y < 0 )
+      return false;
+   XYZ p = u0*x + u1*y;
+   XYZ q = p.normalized();
+   double dist = q.dist( b );
+   if ( !(dist < 1+pad) )
+      return false;
+
+   XYZ g = dist > 0 ? (q-b) / dist : XYZ(); // d(dist)/dq, none if b is on the line
+   XYZ gp = normalizedDerivative( p, g );
+   XYZ g0 = normalizedDerivative( a0, gp * x );
+   XYZ g1 = normalizedDerivative( a1, gp * y );
+   res.r = (1+pad)-dist;
+   res.error = max(0.,1-dist);
+   res.numVertices = 4;
+   res.vertex[0] = curves.center[k];
+   res.vertex[1] = curves.a0[k];
+   res.vertex[2] = curves.a1[k];
+   res.vertex[3] = curves.b[k];
+   res.d[0] = _InvRotations[curves.centerElem[k]] * (g0 + g1 - g);
+   res.d[1] = _InvRotations[curves.a0Elem[k]]     * -g0;
+   res.d[2] = _InvRotations[curves.a1Elem[k]]     * -g1;
+   res.d[3] = _InvRotations[curves.bElem[k]]      * g;
+   return true;
+}
+
+// one L-BFGS iteration on the energy of evalEnergy
+// - vertices stay on the sphere: gradients are projected onto the tangent planes and moved vertices are renormalized
+// - backtracking line search, the first trial step is limited to _LbfgsMaxMove per vertex
+// - returns the errors at the start of the iteration, like the gradient step
+double Simulation::stepLbfgs( double& paddingError )
+{
+   LbfgsState& lb = _Lbfgs;
+   int numVertices = (int) _Graph->_Vertices.size();
+
+   gatherPositions();
+   if ( lb.pos != _Pos )
+   {
+      lb = LbfgsState();
+      lb.pos = _Pos;
+      lb.energy = evalEnergy( lb.grad, lb.totalError, lb.paddingError );
+   }
+   paddingError = lb.paddingError;
+   double totalError = lb.totalError;
+   if ( lb.energy == 0 )
+      return totalError;
+
+   // two-loop recursion: dir = -H * grad
+   int m = (int) lb.s.size();
+   vector<XYZ> dir = lb.grad;
+   vector<double> alpha( m );
+   for ( int j = m-1; j >= 0; j-- )
+   {
+      alpha[j] = lb.rho[j] * dot( lb.s[j], dir );
+      for ( int i = 0; i < numVertices; i++ )
+         dir[i] -= lb.y[j][i] * alpha[j];
+   }
+   double gamma = m > 0 ? 1 / (lb.rho[m-1] * dot( lb.y[m-1], lb.y[m-1] )) : 1;
+   for ( XYZ& d : dir )
+      d *= -gamma;
+   for ( int j = 0; j < m; j++ )
+   {
+      double beta = lb.rho[j] * dot( lb.y[j], dir );
+      for ( int i = 0; i < numVertices; i++ )
+         dir[i] -= lb.s[j][i] * (alpha[j] + beta);
+   }
+   for ( int i = 0; i < numVertices; i++ )
+   {
+      XYZ n = lb.pos[i].normalized();
+      dir[i] -= n * (n*dir[i]);
+   }
+   double slope = dot( lb.grad, dir );
+   if ( !(slope < 0) ) // not a descent direction, start over from steepest descent
+   {
+      lb.s.clear();
+      lb.y.clear();
+      lb.rho.clear();
+      for ( int i = 0; i < numVertices; i++ )
+         dir[i] = -lb.grad[i];
+      slope = dot( lb.grad, dir );
+   }
+
+   double maxMove = 0;
+   for ( const XYZ& d : dir )
+      maxMove = max( maxMove, d.len() );
+   double t = min( 1., _LbfgsMaxMove / maxMove );
+
+   vector<XYZ> grad;
+   double energy = 0, newTotalError = 0, newPaddingError = 0;
+   bool found = false;
+   for ( int tries = 0; tries < 30 && !found; tries++, t *= .5 )
+   {
+      for ( int i = 0; i < numVertices; i++ )
+         _Pos[i] = _Graph->_Vertices[i]._IsSymmetrical ? lb.pos[i] : (lb.pos[i] + dir[i] * t).normalized() * _Radius;
+      energy = evalEnergy( grad, newTotalError, newPaddingError );
+      found = energy <= lb.energy + 1e-4 * t * slope;
+   }
+   if ( !found ) // no progress along dir, drop the history and retry from steepest descent next time
+   {
+      _Pos = lb.pos;
+      lb.s.clear();
+      lb.y.clear();
+      lb.rho.clear();
+      return totalError;
+   }
+
+   vector<XYZ> s( numVertices ), y( numVertices );
+   for ( int i = 0; i < numVertices; i++ )
+   {
+      s[i] = _Pos[i] - lb.pos[i];
+      y[i] = grad[i] - lb.grad[i];
+   }
+   double sy = dot( s, y );
+   if ( sy > 1e-12 * dot( y, y ) && sy > 0 )
+   {
+      if ( (int) lb.s.size() >= _LbfgsHistory )
+      {
+         lb.s.erase( lb.s.begin() );
+         lb.y.erase( lb.y.begin() );
+         lb.rho.erase( lb.rho.begin() );
+      }
+      lb.s.push_back( s );
+      lb.y.push_back( y );
+      lb.rho.push_back( 1 / sy );
+   }
+
+   for ( int i = 0; i < numVertices; i++ )
+      _Graph->_Vertices[i]._Pos = _Pos[i];
+   lb.pos = _Pos;
+   lb.grad = grad;
+   lb.energy = energy;
+   lb.totalError = newTotalError;
+   lb.paddingError = newPaddingError;
+   return totalError;
+}
+
+// one Levenberg-Marquardt iteration on the residuals of evalEnergy
+// - solves (J'J + lambda*D) dx = -J'r, D = diag(J'J), with conjugate gradients (J is only used through its rows)
+// - the unknowns are the tangent plane offsets of the free vertices, moved vertices are renormalized
+// - lambda shrinks after a successful iteration and grows until the cost goes down
+// - returns the errors at the start of the iteration, like the gradient step
+double Simulation::stepLevenbergMarquardt( double& paddingError )
+{
+   int numVertices = (int) _Graph->_Vertices.size();
+
+   gatherPositions();
+   vector<XYZ> grad;
+   double totalError;
+   double cost = evalEnergy( grad, totalError, paddingError );
+   if ( cost == 0 )
+      return totalError;
+
+   vector<Residual> rows;
+   for ( ThreadState& state : _ThreadStates )
+      rows.insert( rows.end(), state.residuals.begin(), state.residuals.end() );
+
+   vector<XYZ> normal( numVertices );
+   vector<bool> isFree( numVertices );
+   for ( int i = 0; i < numVertices; i++ )
+   {
+      normal[i] = _Pos[i].normalized();
+      isFree[i] = !_Graph->_Vertices[i]._IsSymmetrical;
+   }
+   auto tangent = [&]( int i, const XYZ& v ) { return isFree[i] ? v - normal[i] * (normal[i]*v) : XYZ(); };
+
+   vector<double> diag( numVertices, 0. );
+   for ( const Residual& res : rows )
+      for ( int j = 0; j < res.numVertices; j++ )
+         diag[res.vertex[j]] += tangent( res.vertex[j], res.d[j] ).len2();
+
+   // out = (J'J + lambda*D) v
+   double lambda = _LmLambda;
+   vector<double> jv( rows.size() );
+   auto applyNormalMatrix = [&]( const vector<XYZ>& v, vector<XYZ>& out ) {
+      for ( int k = 0; k < (int) rows.size(); k++ )
+      {
+         double sum = 0;
+         for ( int j = 0; j < rows[k].numVertices; j++ )
+            sum += rows[k].d[j] * v[rows[k].vertex[j]];
+         jv[k] = sum;
+      }
+      for ( int i = 0; i < numVertices; i++ )
+         out[i] = v[i] * (lambda * diag[i]);
+      for ( int k = 0; k < (int) rows.size(); k++ )
+         for ( int j = 0; j < rows[k].numVertices; j++ )
+            out[rows[k].vertex[j]] += rows[k].d[j] * jv[k];
+      for ( int i = 0; i < numVertices; i++ )
+         out[i] = tangent( i, out[i] );
+   };
+
+   vector<XYZ> dx( numVertices ), r( numVertices ), z( numVertices ), p( numVertices ), Ap( numVertices );
+   for ( int tries = 0; tries < 10; tries++ )
+   {
+      // Jacobi preconditioned conjugate gradients, starting from dx = 0
+      auto precondition = [&]( int i ) { return diag[i] > 0 ? r[i] / ((1+lambda) * diag[i]) : XYZ(); };
+      double rhsLen2 = 0;
+      for ( int i = 0; i < numVertices; i++ )
+      {
+         dx[i] = XYZ();
+         r[i] = -grad[i];
+         z[i] = precondition( i );
+         p[i] = z[i];
+         rhsLen2 += r[i].len2();
+      }
+      double rz = dot( r, z );
+      for ( int iter = 0; iter < _LmMaxCgIterations && rz > 0; iter++ )
+      {
+         applyNormalMatrix( p, Ap );
+         double pAp = dot( p, Ap );
+         if ( !(pAp > 0) )
+            break;
+         double alpha = rz / pAp;
+         double rLen2 = 0;
+         for ( int i = 0; i < numVertices; i++ )
+         {
+            dx[i] += p[i] * alpha;
+            r[i] -= Ap[i] * alpha;
+            rLen2 += r[i].len2();
+         }
+         if ( rLen2 <= 1e-12 * rhsLen2 )
+            break;
+         for ( int i = 0; i < numVertices; i++ )
+            z[i] = precondition( i );
+         double rzNew = dot( r, z );
+         for ( int i = 0; i < numVertices; i++ )
+            p[i] = z[i] + p[i] * (rzNew / rz);
+         rz = rzNew;
+      }
+
+      vector<XYZ> oldPos = _Pos;
+      for ( int i = 0; i < numVertices; i++ ) if ( isFree[i] )
+         _Pos[i] = (oldPos[i] + dx[i]).normalized() * _Radius;
+      vector<XYZ> newGrad;
+      double newTotalError, newPaddingError;
+      double newCost = evalEnergy( newGrad, newTotalError, newPaddingError );
+      if ( newCost < cost )
+      {
+         for ( int i = 0; i < numVertices; i++ )
+            _Graph->_Vertices[i]._Pos = _Pos[i];
+         _LmLambda = max( lambda / 3, 1e-9 );
+         return totalError;
+      }
+      _Pos = oldPos;
+      lambda *= 4;
+      _LmLambda = min( lambda, 1e9 );
+   }
+   return totalError;
+}
+
+bool Simulation::residualOf( ConstraintKind kind, int k, Residual& res ) const
+{
+   switch ( kind )
+   {
+   case KEEP_CLOSE_FAR: return keepCloseFarResidual( k, res );
+   case STRAIGHT_LINE:  return straightLineResidual( k, res );
+   case CURVED_LINE:    return curvedLineResidual( k, res );
+   }
+   return false;
+}
+
+// greedy coloring of the active constraints so that no two constraints of a color move the same vertex
+// - symmetrical vertices never move, so they don't conflict
+void Simulation::colorConstraints()
+{
+   ConstraintColoring& coloring = _PbdColoring;
+   int numVertices = (int) _Pos.size();
+
+   vector<ConstraintKind> kinds;
+   vector<int> indices;
+   for ( int k = 0; k < _CompiledKeepCloseFars.size(); k++ )
+   {
+      kinds.push_back( KEEP_CLOSE_FAR );
+      indices.push_back( k );
+   }
+   for ( int k : _ActiveStraightLines )
+   {
+      kinds.push_back( STRAIGHT_LINE );
+      indices.push_back( k );
+   }
+   for ( int k : _ActiveCurvedLines )
+   {
+      kinds.push_back( CURVED_LINE );
+      indices.push_back( k );
+   }
+
+   vector<vector<bool>> isColorUsed( numVertices ); // vertex -> color -> used by a constraint
+   vector<int> colorOf( kinds.size() );
+   int numColors = 0;
+   for ( int c = 0; c < (int) kinds.size(); c++ )
+   {
+      int vertices[4];
+      int n = verticesOf( kinds[c], indices[c], vertices );
+      int color = 0;
+      for ( bool isFree = false; !isFree; )
+      {
+         isFree = true;
+         for ( int j = 0; j < n; j++ )
+            if ( color < (int) isColorUsed[vertices[j]].size() && isColorUsed[vertices[j]][color] )
+            {
+               isFree = false;
+               color++;
+               break;
+            }
+      }
+      for ( int j = 0; j < n; j++ )
+      {
+         if ( (int) isColorUsed[vertices[j]].size() <= color )
+            isColorUsed[vertices[j]].resize( color+1 );
+         isColorUsed[vertices[j]][color] = true;
+      }
+      colorOf[c] = color;
+      numColors = max( numColors, color+1 );
+   }
+
+   // counting sort by color
+   coloring.begin.assign( numColors+1, 0 );
+   for ( int color : colorOf )
+      coloring.begin[color+1]++;
+   for ( int color = 0; color < numColors; color++ )
+      coloring.begin[color+1] += coloring.begin[color];
+   coloring.kind.resize( kinds.size() );
+   coloring.index.resize( kinds.size() );
+   vector<int> next( coloring.begin.begin(), coloring.begin.end()-1 );
+   for ( int c = 0; c < (int) kinds.size(); c++ )
+   {
+      int dst = next[colorOf[c]]++;
+      coloring.kind[dst] = kinds[c];
+      coloring.index[dst] = indices[c];
+   }
+   coloring.numBroadPhaseBuilds = _NumBroadPhaseBuilds;
+}
+
+// the free (non symmetrical) vertices of a constraint, without duplicates
+int Simulation::verticesOf( ConstraintKind kind, int k, int* vertices ) const
+{
+   int all[4];
+   int n = 0;
+   if ( kind == KEEP_CLOSE_FAR )
+   {
+      all[n++] = _CompiledKeepCloseFars.a[k];
+      all[n++] = _CompiledKeepCloseFars.b[k];
+   }
+   else
+   {
+      const CompiledLineVertexConstraints& lines = kind == STRAIGHT_LINE ? _CompiledStraightLines : _CompiledCurvedLines;
+      all[n++] = lines.a0[k];
+      all[n++] = lines.a1[k];
+      all[n++] = lines.b[k];
+      if ( kind == CURVED_LINE )
+         all[n++] = lines.center[k];
+   }
+
+   int numFree = 0;
+   for ( int j = 0; j < n; j++ )
+      if ( !_Graph->_Vertices[all[j]]._IsSymmetrical && find( vertices, vertices+numFree, all[j] ) == vertices+numFree )
+         vertices[numFree++] = all[j];
+   return numFree;
+}
+
+// one position based dynamics sweep: every violated constraint is projected onto its (linearized) feasible set in turn,
+// the colors are processed one after the other and the constraints of a color in parallel
+// - the errors are those of the constraints when they were visited
+// - where constraints undo each other's projections the sweeps only creep towards a solution, _PbdMomentum keeps them going
+double Simulation::stepPositionBased( double& paddingError )
+{
+   int numVertices = (int) _Graph->_Vertices.size();
+
+   gatherPositions();
+   updateBroadPhase();
+   if ( _PbdColoring.numBroadPhaseBuilds != _NumBroadPhaseBuilds )
+      colorConstraints();
+
+   const ConstraintColoring& coloring = _PbdColoring;
+   for ( ThreadState& state : _ThreadStates )
+   {
+      state.totalError = 0;
+      state.paddingError = 0;
+   }
+   for ( int color = 0; color+1 < (int) coloring.begin.size(); color++ )
+   {
+      runParallel( [&]( int threadIdx ) {
+         ThreadState& state = _ThreadStates[threadIdx];
+         int begin, end;
+         rangeOf( coloring.begin[color+1] - coloring.begin[color], threadIdx, begin, end );
+         Residual res;
+         for ( int c = coloring.begin[color] + begin; c < coloring.begin[color] + end; c++ )
+         {
+            if ( !residualOf( (ConstraintKind) coloring.kind[c], coloring.index[c], res ) )
+               continue;
+            state.totalError += res.error;
+            state.paddingError += abs( res.r );
+
+            // merge repeated vertices, dx = -r * d / |d|^2 over the free vertices (d projected onto the sphere)
+            int numFree = 0;
+            int vertices[4];
+            XYZ d[4];
+            for ( int j = 0; j < res.numVertices; j++ ) if ( !_Graph->_Vertices[res.vertex[j]]._IsSymmetrical )
+            {
+               int f = int( find( vertices, vertices+numFree, res.vertex[j] ) - vertices );
+               if ( f == numFree )
+               {
+                  vertices[numFree++] = res.vertex[j];
+                  d[f] = XYZ();
+               }
+               d[f] += res.d[j];
+            }
+            double len2 = 0;
+            for ( int f = 0; f < numFree; f++ )
+            {
+               XYZ n = _Pos[vertices[f]].normalized(); // only the tangential part of a move survives the renormalization
+               d[f] -= n * (n*d[f]);
+               len2 += d[f].len2();
+            }
+            if ( len2 == 0 )
+               continue;
+            for ( int f = 0; f < numFree; f++ )
+               _Pos[vertices[f]] = (_Pos[vertices[f]] - d[f] * (_PbdStiffness * res.r / len2)).normalized() * _Radius;
+         }
+      } );
+   }
+
+   double totalError = 0;
+   paddingError = 0;
+   for ( const ThreadState& state : _ThreadStates )
+   {
+      totalError += state.totalError;
+      paddingError += state.paddingError;
+   }
+
+   // momentum, restarted whenever the padding error went up
+   bool restart = (int) _PbdLastPos.size() != numVertices || !( paddingError < _PbdLastPaddingError );
+   _PbdLastPaddingError = paddingError;
+   _PbdLastPos.resize( numVertices );
+   runParallel( [&]( int threadIdx ) {
+      int begin, end;
+      rangeOf( numVertices, threadIdx, begin, end );
+      for ( int i = begin; i < end; i++ )
+      {
+         XYZ pos = _Pos[i];
+         if ( !restart && _PbdMomentum > 0 && !_Graph->_Vertices[i]._IsSymmetrical )
+            _Pos[i] = ( pos + ( pos - _PbdLastPos[i] ) * _PbdMomentum ).normalized() * _Radius;
+         _PbdLastPos[i] = pos;
+         _Graph->_Vertices[i]._Pos = _Pos[i];
+      }
+   } );
+   return totalError;
+}
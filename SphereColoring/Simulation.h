@@ -1,23 +1,164 @@
 #pragma once
 
 #include "Model.h"
+#include "ThreadPool.h"
+#include "ConvergenceMonitor.h"
 #include <memory>
 
 class Simulation
 {
 public:
-   void init( shared_ptr<Dual> dual, std::shared_ptr<Graph> graph, double radius );
+   // KeepCloseFars flattened into parallel arrays (see compileConstraints)
+   struct CompiledKeepCloseFars
+   {
+      enum Type : uint8_t { KEEP_CLOSE = 1, KEEP_FAR = 2 };
+      int size() const { return (int) a.size(); }
+      void clear() { *this = CompiledKeepCloseFars(); }
+      void append( const CompiledKeepCloseFars& from, int k ) { a.push_back( from.a[k] ); b.push_back( from.b[k] ); aElem.push_back( from.aElem[k] ); bElem.push_back( from.bElem[k] ); aSlot.push_back( from.aSlot[k] ); bSlot.push_back( from.bSlot[k] ); type.push_back( from.type[k] ); }
+
+      vector<int> a, b;         // vertex indices
+      vector<int> aElem, bElem; // group element indices (into _Rotations)
+      vector<int> aSlot, bSlot; // indices into the (vertex, group element) slot table
+      vector<uint8_t> type;     // KEEP_CLOSE | KEEP_FAR
+   };
+   // LineVertexConstraints flattened into parallel arrays (see compileConstraints)
+   struct CompiledLineVertexConstraints
+   {
+      int size() const { return (int) a0.size(); }
+
+      vector<int> a0, a1, center, b;                 // vertex indices (center is -1 for straight lines)
+      vector<int> a0Elem, a1Elem, centerElem, bElem; // group element indices (into _Rotations)
+   };
+   // a violated (or rigid) constraint for the energy based solvers: r and its derivative w.r.t. the positions of its vertices
+   struct Residual
+   {
+      double r = 0;
+      double error = 0;    // contribution to totalError
+      int numVertices = 0;
+      int vertex[4];
+      XYZ d[4];            // dr/d(vertex position), repeated vertices add up
+   };
+   // what each thread accumulates during a step
+   struct ThreadState
+   {
+      vector<XYZ> vel;                     // energy gradient when using the L-BFGS solver
+      double totalError = 0;
+      double paddingError = 0;
+      double energy = 0;
+      vector<Residual> residuals;
+      double maxDisplacement = 0;          // of any vertex since the last broad phase
+      bool needsActiveSet = false;         // a vertex may have used up the slack of a left-out keep-close/keep-far
+      vector<int> activeStraightLines;     // broad phase output
+      vector<int> activeCurvedLines;
+   };
+
+   // L-BFGS solver state, kept between steps (see stepLbfgs)
+   struct LbfgsState
+   {
+      vector<XYZ> pos;          // vertex positions after the last iteration (the history is dropped if the graph was changed since)
+      vector<XYZ> grad;         // energy gradient at pos, projected onto the sphere
+      double energy = 0;
+      double totalError = 0;
+      double paddingError = 0;
+      vector<vector<XYZ>> s, y; // last position/gradient differences, oldest first
+      vector<double> rho;       // 1/(y*s)
+   };
+   // constraints grouped by color, no two constraints of a color move the same vertex (see colorConstraints)
+   struct ConstraintColoring
+   {
+      vector<int> begin;            // color c is [begin[c], begin[c+1])
+      vector<uint8_t> kind;         // ConstraintKind
+      vector<int> index;            // into the compiled constraints of that kind
+      int numBroadPhaseBuilds = -1; // the active lists it was built from
+   };
+   enum ConstraintKind { KEEP_CLOSE_FAR, STRAIGHT_LINE, CURVED_LINE };
+   enum Solver { GRADIENT_STEP, LBFGS, LEVENBERG_MARQUARDT, POSITION_BASED };
+
+public:
+   void init( shared_ptr<Dual> dual, std::shared_ptr<Graph> graph, double radius, const ProgressCallback& progress = nullptr );
    void normalizeVertices();
    double step( double& paddingError );
    double step( int numSteps );
+   void setNumThreads( int numThreads );
+   int numThreadsInUse() const;
+   void setNumBuildThreads( int numThreads );
+   ThreadPool* buildThreadPool() const { return _BuildThreadPool ? _BuildThreadPool.get() : _ThreadPool.get(); }
+
+private:
+   void compileConstraints();
+   void runParallel( const function<void(int)>& task );
+   void rangeOf( int n, int threadIdx, int& begin, int& end ) const;
+   void gatherPositions();
+   void updateBroadPhase();
+   void updateActiveKeepCloseFars();
+   void updateSlots();
+   double stepLbfgs( double& paddingError );
+   double stepLevenbergMarquardt( double& paddingError );
+   double stepPositionBased( double& paddingError );
+   void colorConstraints();
+   int verticesOf( ConstraintKind kind, int k, int* vertices ) const;
+   bool residualOf( ConstraintKind kind, int k, Residual& res ) const;
+   double evalEnergy( vector<XYZ>& grad, double& totalError, double& paddingError );
+   void collectResiduals( int threadIdx, vector<Residual>& residuals ) const;
+   bool keepCloseFarResidual( int k, Residual& res ) const;
+   bool straightLineResidual( int k, Residual& res ) const;
+   bool curvedLineResidual( int k, Residual& res ) const;
+   void stepKeepCloseFars( int begin, int end, ThreadState& state );
+   void stepStraightLines( int begin, int end, ThreadState& state );
+   void stepCurvedLines( int begin, int end, ThreadState& state );
 
 public:
    double _Radius = 1;
    double _Padding = .0001;
+   Solver _Solver = GRADIENT_STEP;
+   ConvergenceMonitor _Monitor;   // fed by step( numSteps ), reset by init
    double _PaddingError = 0;
    shared_ptr<Graph> _Graph;
    vector<Graph::KeepCloseFar> _KeepCloseFars;
    vector<Graph::LineVertexConstraint> _LineVertexConstraints;
    shared_ptr<Dual> _Dual;
-};
 
+   CompiledKeepCloseFars _CompiledKeepCloseFars;
+   CompiledLineVertexConstraints _CompiledStraightLines;
+   CompiledLineVertexConstraints _CompiledCurvedLines;
+   vector<Rotation3> _Rotations;    // group element index -> matrix
+   vector<Rotation3> _InvRotations; // group element index -> inverse matrix
+   vector<XYZ> _Pos;              // graph vertex positions, gathered at the start of each step
+
+   bool _UseSimd = true;                  // use the AVX2 keep-close/keep-far kernel if the CPU supports it
+   vector<int> _SlotVertex;               // (vertex, group element) pairs used by the keep-close/keep-far constraints
+   vector<int> _SlotElem;
+   vector<double> _SlotX, _SlotY, _SlotZ; // world position of each slot, updated every step
+   vector<double> _KeepCloseFarCoef;    // per active keep-close/keep-far
+
+   bool _UseActiveSet = true;                  // leave out the keep-close/keep-far constraints that are satisfied by a wide margin
+   double _ActiveSetMargin = .02;              // constraints with at least this much slack are left out until their vertices move
+   CompiledKeepCloseFars _ActiveKeepCloseFars; // the constraints the gradient step evaluates
+   vector<int> _ActiveSlots;                   // the slots they use
+   vector<double> _SleepingSlack;              // vertex -> smallest slack of the left-out constraints on it
+   vector<XYZ> _ActiveSetPos;                  // vertex positions when the active set was built
+
+   bool _UseBroadPhase = true;       // skip line-vertex constraints whose arc and vertex are far apart
+   double _BroadPhaseMargin = .5;    // how close (beyond 1+padding) a constraint must be to stay in the active lists
+   int _BroadPhaseInterval = 1000;   // rebuild the active lists at least this often (in steps)
+   vector<int> _ActiveStraightLines; // indices into _CompiledStraightLines
+   vector<int> _ActiveCurvedLines;   // indices into _CompiledCurvedLines
+   vector<XYZ> _BroadPhasePos;       // vertex positions when the active lists were built
+   int _StepsSinceBroadPhase = 0;
+   int _NumBroadPhaseBuilds = 0;
+
+   LbfgsState _Lbfgs;
+   int _LbfgsHistory = 8;       // number of (s,y) pairs kept
+   double _LbfgsMaxMove = .05;  // no vertex moves further than this in one iteration
+   double _LmLambda = 1e-3;     // Levenberg-Marquardt damping, adapted every iteration
+   int _LmMaxCgIterations = 200;
+   ConstraintColoring _PbdColoring;
+   double _PbdStiffness = 1;    // fraction of each constraint's violation removed per projection
+   double _PbdMomentum = .9;    // fraction of the last sweep's move that is added to the next one
+   vector<XYZ> _PbdLastPos;     // positions after the last sweep, before the momentum was added
+   double _PbdLastPaddingError = 0;
+
+   shared_ptr<ThreadPool> _ThreadPool; // null when running single-threaded
+   shared_ptr<ThreadPool> _BuildThreadPool; // builds the graph and constraints, null to use _ThreadPool
+   vector<ThreadState> _ThreadStates;
+};
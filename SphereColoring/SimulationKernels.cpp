@@ -0,0 +1,157 @@
+#include "SimulationKernels.h"
+#include "Simulation.h"
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#define HAS_X86_SIMD 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define TARGET_AVX2
+#else
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+using namespace std;
+
+namespace
+{
+   const uint8_t KEEP_CLOSE = Simulation::CompiledKeepCloseFars::KEEP_CLOSE;
+   const uint8_t KEEP_FAR = Simulation::CompiledKeepCloseFars::KEEP_FAR;
+   const double GAIN = .03;
+}
+
+void keepCloseFarKernelScalar( const KeepCloseFarKernelData& data, int begin, int end, double* coef, double& totalError, double& paddingError )
+{
+   for ( int k = begin; k < end; k++ )
+   {
+      int sa = data.aSlot[k];
+      int sb = data.bSlot[k];
+      double dx = data.x[sb] - data.x[sa];
+      double dy = data.y[sb] - data.y[sa];
+      double dz = data.z[sb] - data.z[sa];
+      double dist = sqrt( dx*dx + dy*dy + dz*dz );
+
+      bool keepClose = data.type[k] & KEEP_CLOSE;
+      bool keepFar = data.type[k] & KEEP_FAR;
+      double pad = keepClose && keepFar ? 0 : data.padding;
+      double c = 0;
+      if ( keepClose && dist >= 1.-pad )
+      {
+         c += (dist-(1-pad)) * GAIN;
+         totalError += max(0.,dist-1);
+         paddingError += dist-(1-pad);
+      }
+      if ( keepFar && dist <= 1.+pad )
+      {
+         c -= ((1+pad)-dist) * GAIN / dist; // (b-a)/dist is the normalized direction
+         totalError += max(0.,1-dist);
+         paddingError += (1+pad)-dist;
+      }
+      coef[k] = c;
+   }
+}
+
+#ifdef HAS_X86_SIMD
+
+namespace
+{
+   TARGET_AVX2 double horizontalSum( __m256d v )
+   {
+      __m128d sum = _mm_add_pd( _mm256_castpd256_pd128( v ), _mm256_extractf128_pd( v, 1 ) );
+      return _mm_cvtsd_f64( _mm_add_sd( sum, _mm_unpackhi_pd( sum, sum ) ) );
+   }
+
+   TARGET_AVX2 __m256d typeMask( __m256i type, uint8_t bit )
+   {
+      __m256i b = _mm256_set1_epi64x( bit );
+      return _mm256_castsi256_pd( _mm256_cmpeq_epi64( _mm256_and_si256( type, b ), b ) );
+   }
+}
+
+// same as keepCloseFarKernelScalar, 4 constraints at a time
+TARGET_AVX2 void keepCloseFarKernelAvx2( const KeepCloseFarKernelData& data, int begin, int end, double* coef, double& totalError, double& paddingError )
+{
+   const __m256d zero = _mm256_setzero_pd();
+   const __m256d one = _mm256_set1_pd( 1. );
+   const __m256d gain = _mm256_set1_pd( GAIN );
+   const __m256d padding = _mm256_set1_pd( data.padding );
+   __m256d sumError = zero;
+   __m256d sumPaddingError = zero;
+
+   int k = begin;
+   for ( ; k + 4 <= end; k += 4 )
+   {
+      __m128i sa = _mm_loadu_si128( (const __m128i*) ( data.aSlot + k ) );
+      __m128i sb = _mm_loadu_si128( (const __m128i*) ( data.bSlot + k ) );
+      __m256d dx = _mm256_sub_pd( _mm256_i32gather_pd( data.x, sb, 8 ), _mm256_i32gather_pd( data.x, sa, 8 ) );
+      __m256d dy = _mm256_sub_pd( _mm256_i32gather_pd( data.y, sb, 8 ), _mm256_i32gather_pd( data.y, sa, 8 ) );
+      __m256d dz = _mm256_sub_pd( _mm256_i32gather_pd( data.z, sb, 8 ), _mm256_i32gather_pd( data.z, sa, 8 ) );
+      __m256d dist = _mm256_sqrt_pd( _mm256_add_pd( _mm256_add_pd( _mm256_mul_pd( dx, dx ), _mm256_mul_pd( dy, dy ) ), _mm256_mul_pd( dz, dz ) ) );
+
+      int32_t types;
+      memcpy( &types, data.type + k, sizeof( types ) );
+      __m256i type = _mm256_cvtepu8_epi64( _mm_cvtsi32_si128( types ) );
+      __m256d keepClose = typeMask( type, KEEP_CLOSE );
+      __m256d keepFar = typeMask( type, KEEP_FAR );
+      __m256d pad = _mm256_andnot_pd( _mm256_and_pd( keepClose, keepFar ), padding ); // rigid edges have no padding
+
+      __m256d closeLimit = _mm256_sub_pd( one, pad );
+      __m256d farLimit = _mm256_add_pd( one, pad );
+      __m256d closeActive = _mm256_and_pd( keepClose, _mm256_cmp_pd( dist, closeLimit, _CMP_GE_OQ ) );
+      __m256d farActive = _mm256_and_pd( keepFar, _mm256_cmp_pd( dist, farLimit, _CMP_LE_OQ ) );
+      __m256d closeExcess = _mm256_and_pd( closeActive, _mm256_sub_pd( dist, closeLimit ) );
+      __m256d farExcess = _mm256_and_pd( farActive, _mm256_sub_pd( farLimit, dist ) );
+
+      __m256d c = _mm256_sub_pd( _mm256_mul_pd( closeExcess, gain ), _mm256_and_pd( farActive, _mm256_div_pd( _mm256_mul_pd( farExcess, gain ), dist ) ) );
+      _mm256_storeu_pd( coef + k, c );
+
+      __m256d closeError = _mm256_and_pd( closeActive, _mm256_max_pd( zero, _mm256_sub_pd( dist, one ) ) );
+      __m256d farError = _mm256_and_pd( farActive, _mm256_max_pd( zero, _mm256_sub_pd( one, dist ) ) );
+      sumError = _mm256_add_pd( sumError, _mm256_add_pd( closeError, farError ) );
+      sumPaddingError = _mm256_add_pd( sumPaddingError, _mm256_add_pd( closeExcess, farExcess ) );
+   }
+   totalError += horizontalSum( sumError );
+   paddingError += horizontalSum( sumPaddingError );
+
+   keepCloseFarKernelScalar( data, k, end, coef, totalError, paddingError );
+}
+
+bool cpuHasAvx2()
+{
+#ifdef _MSC_VER
+   int info[4];
+   __cpuid( info, 0 );
+   if ( info[0] < 7 )
+      return false;
+   __cpuid( info, 1 );
+   bool osUsesXSave = ( info[2] & (1<<27) ) != 0;
+   bool hasAvx = ( info[2] & (1<<28) ) != 0;
+   if ( !osUsesXSave || !hasAvx || ( _xgetbv( 0 ) & 6 ) != 6 ) // OS must save the YMM registers
+      return false;
+   __cpuidex( info, 7, 0 );
+   return ( info[1] & (1<<5) ) != 0;
+#else
+   return __builtin_cpu_supports( "avx2" );
+#endif
+}
+
+#else
+
+void keepCloseFarKernelAvx2( const KeepCloseFarKernelData& data, int begin, int end, double* coef, double& totalError, double& paddingError )
+{
+   keepCloseFarKernelScalar( data, begin, end, coef, totalError, paddingError );
+}
+
+bool cpuHasAvx2() { return false; }
+
+#endif
+
+KeepCloseFarKernel bestKeepCloseFarKernel()
+{
+   static KeepCloseFarKernel s_kernel = cpuHasAvx2() ? keepCloseFarKernelAvx2 : keepCloseFarKernelScalar;
+   return s_kernel;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstdint>
+
+// inputs of the keep-close/keep-far kernel, all arrays are indexed by constraint except x/y/z which are indexed by slot
+struct KeepCloseFarKernelData
+{
+   const double* x;      // world position of each slot
+   const double* y;
+   const double* z;
+   const int* aSlot;
+   const int* bSlot;
+   const uint8_t* type;  // Simulation::CompiledKeepCloseFars::Type bits
+   double padding;
+};
+
+// evaluates constraints [begin,end)
+// - coef[k] is set so that (b-a)*coef[k] is the push on endpoint a (and -(b-a)*coef[k] the push on b), 0 if the constraint is satisfied
+// - adds the error of the violated constraints to totalError/paddingError
+typedef void (*KeepCloseFarKernel)( const KeepCloseFarKernelData& data, int begin, int end, double* coef, double& totalError, double& paddingError );
+
+void keepCloseFarKernelScalar( const KeepCloseFarKernelData& data, int begin, int end, double* coef, double& totalError, double& paddingError );
+void keepCloseFarKernelAvx2( const KeepCloseFarKernelData& data, int begin, int end, double* coef, double& totalError, double& paddingError );
+
+bool cpuHasAvx2();
+KeepCloseFarKernel bestKeepCloseFarKernel(); // AVX2 if the CPU supports it, scalar otherwise
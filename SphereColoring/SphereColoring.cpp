@@ -2,147 +2,21 @@
 #include "Drawing.h"
 #include "Model.h"
 #include "PlatformSpecific.h"
+#include "DualIO.h"
 #include <QDebug>
 #include <QShortcut>
 #include <QMouseEvent>
-#include <QJsonDocument>
-#include <QJsonArray>
-#include <QJsonObject>
-#include <QFile>
 #include <QFileDialog>
 
 #include <vector>
 #include <sstream>
 #include <iomanip>
+#include <thread>
 
 
 using namespace std;
 
 
-shared_ptr<Graph> makeGraph( shared_ptr<const Dual> dual, double radius )
-{
-   shared_ptr<Graph> graph( new Graph );
-   
-   std::map<set<int>, int> polygonToTileIndex;
-
-   for ( int k = 0; k < (int) dual->_Vertices.size(); k++ )
-   {
-      Dual::VertexPtr a = dual->fromId( k );
-
-      Graph::Tile tile;
-      tile._Index = (int) graph->_Tiles.size();
-      tile._Color = dual->colorOf( a );
-      tile._SymmetryMap = dual->_Vertices[a._Index]._SymmetryMap;
-
-      for ( const Dual::VertexPtr& b : dual->sortedNeighborsOf( a ) )
-      {
-         vector<Dual::VertexPtr> poly = dual->polygon( a, b );
-
-         Graph::VertexPtr tileVertex;
-         set<int> polyAsSet;
-         for ( const Dual::VertexPtr& c : poly )
-            polyAsSet.insert( dual->idOf( c ) );
-
-         {
-            for ( const IcoSymmetry::Config& config : GlobalSymmetry::matrices() )
-            {
-               set<int> polyAsSet;
-               for ( const Dual::VertexPtr& c : poly )
-                  polyAsSet.insert( dual->idOf( dual->premul( c, config.m ) ) );
-               if ( polygonToTileIndex.count( polyAsSet ) )
-               {
-                  tileVertex = Graph::VertexPtr( polygonToTileIndex.at(polyAsSet), config.m.inverted() );
-                  break;
-               }
-            }
-         }         
-
-         if ( !tileVertex.isValid() ) // create it if needed
-         {
-            XYZ sum;
-            for ( const Dual::VertexPtr& c : poly )
-               sum += dual->posOf( c );
-
-            Graph::Vertex v( (int) graph->_Vertices.size() );
-            v._IsSymmetrical = MatrixSymmetryMap::symmetryFor( sum )->hasSymmetry();
-            v._Neighbors;
-            v._Pos = sum.normalized() * radius;
-            v._Tiles;
-            graph->_Vertices.push_back( v );
-            tileVertex = Graph::VertexPtr( v._Index, QMtx4x4() );
-            polygonToTileIndex[polyAsSet] = v._Index;
-         }
-
-         tile._Vertices.push_back( tileVertex );         
-      }
-      graph->_Tiles.push_back( tile );
-      for ( const Graph::VertexPtr& vtx : tile._Vertices )
-         if ( tile._SymmetryMap->isReal( vtx._Mtx ) ) // only add one copy
-            graph->_Vertices[vtx._Index]._Tiles.push_back( Graph::TilePtr( tile._Index, vtx._Mtx.inverted() ) );
-      for ( int i = 0; i < (int) tile._Vertices.size(); i++ )
-         graph->addNeighbor( tile._Vertices[i], tile._Vertices[(i+1)%tile._Vertices.size()] );
-   }
-
-
-//   for ( const Graph::VertexPtr& a : graph->allVertices() )
-//      for ( const Graph::VertexPtr& b : graph->neighbors( a ) )
-//         qDebug() << graph->idOf( a ) << "-" << graph->idOf( b );
-
-   return graph;
-}
-
-
-void saveDual( const QString& filename, const Dual& dual )
-{
-   if ( filename.isEmpty() )
-      return;
-   
-   QJsonArray vertices;
-   for ( const Dual::Vertex& a : dual._Vertices )
-      vertices.push_back( QJsonObject { { "color", a._Color }, { "x", a._Pos.x }, { "y", a._Pos.y }, { "z", a._Pos.z } } );
-
-   QJsonArray edges;
-   for ( const Dual::Vertex& a : dual._Vertices )
-      for ( const Dual::VertexPtr& b : a._Neighbors ) if ( a._Index <= b._Index )
-         edges.push_back( QJsonArray { a._Index, b._Index, MatrixIndexMap::indexOf( b._Mtx ) } );
-   QJsonObject graph = { { "vertices", vertices }, { "edges", edges }, { "symmetry", QString::fromStdString( GlobalSymmetry::symmetry()->name() ) } };         
-   {
-      QFile f( filename );
-      f.open(QFile::WriteOnly);
-      f.write(QJsonDocument( graph ).toJson());            
-   }   
-}
-
-shared_ptr<Dual> loadDual( const QString& filename )
-{
-   if ( filename.isEmpty() )
-      return nullptr;
-
-   QFile f( filename );
-   f.open( QFile::ReadOnly );
-   QJsonDocument doc = QJsonDocument::fromJson( f.readAll() );
-
-   GlobalSymmetry::setSymmetry( doc["symmetry"].toString().toStdString() );
-   MatrixIndexMap::update();
-
-   shared_ptr<Dual> dual( new Dual );
-
-   for ( const QJsonValue& vertex_ : doc["vertices"].toArray() )
-   {
-      QJsonObject vertex = vertex_.toObject();
-      dual->addVertex( vertex["color"].toInt(), XYZ( vertex["x"].toDouble(), vertex["y"].toDouble(), vertex["z"].toDouble() ) );      
-      dual->_Vertices.back()._SymmetryMap = MatrixSymmetryMap::symmetryFor( dual->_Vertices.back()._Pos );
-   }
-   for ( const QJsonValue& edge_ : doc["edges"].toArray() )
-   {
-      QJsonArray edge = edge_.toArray();
-      dual->toggleEdge( Dual::VertexPtr( edge[0].toInt(), QMtx4x4() ), Dual::VertexPtr( edge[1].toInt(), MatrixIndexMap::at( edge[2].toInt() ) ), true/*only add edges*/ );
-   }
-   return dual;
-}
-
-
-
 SphereColoring::SphereColoring( QWidget *parent )
    : QMainWindow( parent )
 {
@@ -157,6 +31,7 @@ SphereColoring::SphereColoring( QWidget *parent )
    radius = dual->_Vertices[0]._Pos.len();
    //shared_ptr<Graph> graph = makeGraph( dual, radius );
    shared_ptr<Graph> graph = nullptr;
+   _Simulation.setNumBuildThreads( (int) thread::hardware_concurrency() ); // the steps stay single-threaded
    _Simulation.init( dual, graph, radius );
    ui.drawing->_Simulation = &_Simulation;
    ui.lineEdit0->setText( "10" );
@@ -202,16 +77,24 @@ SphereColoring::SphereColoring( QWidget *parent )
       }
       else
       {
+         _Simulation._Monitor.reset();
          _Timer.start( 50 );
          ui.playButton->setText( "Pause" );
       }
    } );
    connect( &_Timer, &QTimer::timeout, [this]() {
       double error = _Simulation.step( 500 );
-      ui.errorLabel->setText( "Err:" + QString::number( error ) );
+      QString status = _Simulation._Monitor.isFinished() ? QString( " (" ) + ConvergenceMonitor::nameOf( _Simulation._Monitor.status() ) + ")" : "";
+      ui.errorLabel->setText( "Err:" + QString::number( error ) + status );
       ui.paddingErrorLabel->setText( "Pad:" + QString::number( _Simulation._PaddingError ) );      
       redrawSim();
    } );
+   // stop playing once the simulation converged, stalled or diverged, judged by the padding error, which keeps improving after the error is 0
+   _Simulation._Monitor._WatchPadding = true;
+   _Simulation._Monitor._OnFinished = [this]( ConvergenceMonitor::Status ) {
+      _Timer.stop();
+      ui.playButton->setText( "Play" );
+   };
    
    connect( ui.showDualCheckBox      , &QCheckBox::toggled, [this]() { ui.drawing->_ShowDual       = ui.showDualCheckBox      ->isChecked(); redrawSim(); } );
    connect( ui.drawCurvesCheckBox    , &QCheckBox::toggled, [this]() { ui.drawing->_DrawCurves     = ui.drawCurvesCheckBox    ->isChecked(); redrawSim(); } );
@@ -222,8 +105,9 @@ SphereColoring::SphereColoring( QWidget *parent )
    connect( ui.showViolationsCheckBox, &QCheckBox::toggled, [this]() { ui.drawing->_ShowViolations = ui.showViolationsCheckBox->isChecked(); redrawSim(); } );
 
    connect( ui.dualToGraphButton, &QPushButton::pressed, [this]() {
-      shared_ptr<Graph> graph = makeGraph( _Simulation._Dual, _Simulation._Radius );
-      _Simulation.init( _Simulation._Dual, graph, _Simulation._Radius );
+      ProgressCallback progress = [this]( const char* stage, int done, int total ) { showProgress( stage, done, total ); };
+      shared_ptr<Graph> graph = makeGraph( _Simulation._Dual, _Simulation._Radius, _Simulation.buildThreadPool(), progress );
+      _Simulation.init( _Simulation._Dual, graph, _Simulation._Radius, progress );
       redrawSim();
    } );
 
@@ -347,7 +231,7 @@ void SphereColoring::handleRightButton( const QPoint& mousePos, bool isMove, boo
    {
       QPointF p = mousePos - _MouseRightButtonDownPos;
       XYZ axis = p == QPointF(0,0) ? XYZ(0,0,1) : XYZ( -p.y(), -p.x(), 0 );
-      ui.drawing->_ModelRotation = QMtx4x4::rotation( axis, QLineF( QPointF(), p ).length() * 1.99 / ui.drawing->_Zoom / ui.drawing->height() ) * _PreDragModelRotation;
+      ui.drawing->_ModelRotation = Rotation3::rotation( axis, QLineF( QPointF(), p ).length() * 1.99 / ui.drawing->_Zoom / ui.drawing->height() ) * _PreDragModelRotation;
       redrawSim();
    }
 }
@@ -358,6 +242,15 @@ void SphereColoring::redrawSim() const
    ui.drawing->updateLabel(); 
 }
 
+// the graph is built on the GUI thread, so the label has to be repainted right away
+void SphereColoring::showProgress( const char* stage, int done, int total )
+{
+   if ( done != total && done % max( 1, total / 20 ) != 0 )
+      return;
+   ui.errorLabel->setText( QString( "%1: %2/%3" ).arg( stage ).arg( done ).arg( total ) );
+   ui.errorLabel->repaint();
+}
+
 void SphereColoring::addVertex( int color )
 {
    //if ( color >= 7 )
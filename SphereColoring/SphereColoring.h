@@ -14,6 +14,7 @@ public:
    SphereColoring( QWidget *parent = Q_NULLPTR );
 
    void redrawSim() const;
+   void showProgress( const char* stage, int done, int total );
    void addVertex( int color );   
 
    void handleMouse( const QPoint& mousePos, bool isMove, bool isClick, bool isUnclick );
@@ -32,5 +33,5 @@ private:
    Dual::VertexPtr _EdgeSelectVtx;
 
    QPoint _MouseRightButtonDownPos;
-   QMtx4x4 _PreDragModelRotation;
+   Rotation3 _PreDragModelRotation;
 };
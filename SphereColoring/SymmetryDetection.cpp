@@ -0,0 +1,500 @@
+#include "SymmetryDetection.h"
+
+#include <algorithm>
+#include <numeric>
+
+using namespace std;
+
+namespace
+{
+   const double PI = acos(0.) * 2.;
+   const double TOLERANCE = .1; // for comparing rotations fitted to positions that are only roughly symmetrical
+
+   // (m^-1)^T of a general 3x3 matrix, from the cross products of its columns
+   Rotation3 inverseTransposed( const Rotation3& m )
+   {
+      double det = m[0] * ( m[1] ^ m[2] );
+      return Rotation3( ( m[1] ^ m[2] ) / det, ( m[2] ^ m[0] ) / det, ( m[0] ^ m[1] ) / det );
+   }
+
+   double maxDiff( const Rotation3& a, const Rotation3& b )
+   {
+      double ret = 0;
+      for ( int y = 0; y < 3; y++ )
+         for ( int x = 0; x < 3; x++ )
+            ret = max( ret, abs( a(y,x) - b(y,x) ) );
+      return ret;
+   }
+
+   void axisAngleOf( const Rotation3& m, XYZ& axis, double& angle )
+   {
+      angle = acos( max( -1., min( 1., ( m(0,0) + m(1,1) + m(2,2) - 1 ) / 2 ) ) );
+      axis = XYZ( m(2,1) - m(1,2), m(0,2) - m(2,0), m(1,0) - m(0,1) );
+      if ( axis.len() > 1e-3 )
+      {
+         axis = axis.normalized();
+         return;
+      }
+      // half turn (or identity): m+I has the axis in its columns
+      axis = XYZ( 0, 1, 0 );
+      double best = 0;
+      for ( int c = 0; c < 3; c++ )
+      {
+         XYZ col( m(0,c) + (c==0), m(1,c) + (c==1), m(2,c) + (c==2) );
+         if ( col.len() > best )
+         {
+            best = col.len();
+            axis = col.normalized();
+         }
+      }
+   }
+
+   int orderOf( double angle, int maxOrder )
+   {
+      for ( int k = 1; k <= maxOrder; k++ )
+      {
+         double turns = k * angle / (2*PI);
+         if ( abs( turns - lround( turns ) ) < .01 )
+            return k;
+      }
+      return -1;
+   }
+}
+
+SymmetryDetection::SymmetryDetection( const Dual& dual )
+{
+   SymmetryScope scope( dual._Group );
+   vector<Dual::VertexPtr> vertices = dual.allVertices();
+   unordered_map<int, int> idToIndex;
+   for ( int i = 0; i < (int) vertices.size(); i++ )
+      idToIndex[dual.idOf( vertices[i] )] = i;
+
+   for ( const Dual::VertexPtr& a : vertices )
+   {
+      _Pos.push_back( dual.posOf( a ) );
+      _Colors.push_back( dual.colorOf( a ) );
+      _Neighbors.emplace_back();
+      for ( const Dual::VertexPtr& b : dual.sortedNeighborsOf( a ) )
+         _Neighbors.back().push_back( idToIndex.at( dual.idOf( b ) ) );
+   }
+
+   findRotations();
+   classify();
+}
+
+// every rotation is fixed by where it takes one vertex and which of that vertex's neighbors goes where
+void SymmetryDetection::findRotations()
+{
+   int n = (int) _Pos.size();
+
+   // start from a vertex with the rarest degree to keep the number of candidates down
+   unordered_map<size_t, int> numWithDegree;
+   for ( const vector<int>& neighbors : _Neighbors )
+      numWithDegree[neighbors.size()]++;
+   int x0 = -1;
+   for ( int v = 0; v < n; v++ ) if ( !_Neighbors[v].empty() )
+      if ( x0 < 0 || numWithDegree[_Neighbors[v].size()] < numWithDegree[_Neighbors[x0].size()] )
+         x0 = v;
+
+   vector<int> perm;
+   Perm colorPerm;
+   if ( x0 < 0 || !findAutomorphism( x0, x0, 0, perm, colorPerm ) )
+   {
+      vector<int> identity( n );
+      iota( identity.begin(), identity.end(), 0 );
+      _Perms = { identity };
+      _ColorPerms = { Perm( BLANK_COLOR+1 ) };
+      _Rotations = { Rotation3() };
+      return;
+   }
+   _Perms.push_back( perm );
+   _ColorPerms.push_back( colorPerm );
+   _Rotations.push_back( Rotation3() );
+
+   int degree = (int) _Neighbors[x0].size();
+   for ( int w = 0; w < n; w++ ) if ( (int) _Neighbors[w].size() == degree )
+      for ( int offset = 0; offset < degree; offset++ ) if ( w != x0 || offset != 0 )
+         if ( findAutomorphism( x0, w, offset, perm, colorPerm ) )
+         {
+            _Perms.push_back( perm );
+            _ColorPerms.push_back( colorPerm );
+            _Rotations.push_back( rotationOf( perm ) );
+         }
+}
+
+// grows the map x0 -> w (neighbor k of x0 -> neighbor k+offset of w) over the whole tiling, keeping the cyclic order around every vertex
+bool SymmetryDetection::findAutomorphism( int x0, int w, int offset, vector<int>& perm, Perm& colorPerm ) const
+{
+   int n = (int) _Pos.size();
+   perm.assign( n, -1 );
+   vector<int> offsets( n, 0 ); // neighbor k of v goes to neighbor k+offsets[v] of perm[v]
+   vector<bool> isTarget( n, false );
+   vector<int> colorTo( BLANK_COLOR+1, -1 );
+   vector<int> colorFrom( BLANK_COLOR+1, -1 );
+
+   auto assign = [&]( int x, int y, int off ) {
+      int cx = _Colors[x];
+      int cy = _Colors[y];
+      if ( _Neighbors[x].size() != _Neighbors[y].size() || isTarget[y] || cx < 0 || cx > BLANK_COLOR || cy < 0 || cy > BLANK_COLOR )
+         return false;
+      if ( ( colorTo[cx] >= 0 && colorTo[cx] != cy ) || ( colorFrom[cy] >= 0 && colorFrom[cy] != cx ) )
+         return false;
+      colorTo[cx] = cy;
+      colorFrom[cy] = cx;
+      perm[x] = y;
+      offsets[x] = off;
+      isTarget[y] = true;
+      return true;
+   };
+   auto indexOf = []( const vector<int>& v, int x ) { return int( find( v.begin(), v.end(), x ) - v.begin() ); };
+
+   if ( !assign( x0, w, offset ) )
+      return false;
+   vector<int> queue = { x0 };
+   for ( int q = 0; q < (int) queue.size(); q++ )
+   {
+      int v = queue[q];
+      const vector<int>& from = _Neighbors[v];
+      const vector<int>& to = _Neighbors[perm[v]];
+      int degree = (int) from.size();
+      for ( int k = 0; k < degree; k++ )
+      {
+         int x = from[k];
+         int y = to[(k+offsets[v])%degree];
+         int xDegree = (int) _Neighbors[x].size();
+         int off = mod( indexOf( _Neighbors[y], perm[v] ) - indexOf( _Neighbors[x], v ), max( 1, xDegree ) );
+         if ( perm[x] < 0 )
+         {
+            if ( !assign( x, y, off ) )
+               return false;
+            queue.push_back( x );
+         }
+         else if ( perm[x] != y || offsets[x] != off )
+            return false;
+      }
+   }
+   if ( (int) queue.size() != n )
+      return false; // not connected
+
+   // unused colors go to the unused colors in order
+   colorPerm = Perm( BLANK_COLOR+1 );
+   int nextFree = 0;
+   for ( int c = 0; c <= BLANK_COLOR; c++ )
+   {
+      if ( colorTo[c] >= 0 )
+         colorPerm.v[c] = colorTo[c];
+      else
+      {
+         while ( colorFrom[nextFree] >= 0 )
+            nextFree++;
+         colorPerm.v[c] = nextFree++;
+      }
+   }
+   return true;
+}
+
+// least squares fit: the rotational part (polar decomposition) of sum( perm(p) * p^T )
+Rotation3 SymmetryDetection::rotationOf( const vector<int>& perm ) const
+{
+   double m[3][3] = {};
+   for ( int v = 0; v < (int) _Pos.size(); v++ )
+   {
+      XYZ p = _Pos[v].normalized();
+      XYZ q = _Pos[perm[v]].normalized();
+      double pp[3] = { p.x, p.y, p.z };
+      double qq[3] = { q.x, q.y, q.z };
+      for ( int r = 0; r < 3; r++ )
+         for ( int c = 0; c < 3; c++ )
+            m[r][c] += qq[r] * pp[c];
+   }
+   // not orthonormal until the iteration has converged
+   Rotation3 ret( m[0][0], m[0][1], m[0][2],
+                  m[1][0], m[1][1], m[1][2],
+                  m[2][0], m[2][1], m[2][2] );
+   for ( int i = 0; i < 50; i++ )
+   {
+      Rotation3 next = ret;
+      Rotation3 invT = inverseTransposed( ret );
+      for ( int c = 0; c < 3; c++ )
+         next[c] = ( ret[c] + invT[c] ) * .5;
+      bool done = maxDiff( next, ret ) < 1e-12;
+      ret = next;
+      if ( done )
+         break;
+   }
+   return ret;
+}
+
+// rotation i has to take every vertex closer to its image than to the neighbors of the image
+bool SymmetryDetection::mapsPositions( int i ) const
+{
+   for ( int v = 0; v < (int) _Pos.size(); v++ )
+   {
+      XYZ q = _Pos[_Perms[i][v]].normalized();
+      double spacing = 2;
+      for ( int u : _Neighbors[_Perms[i][v]] )
+         spacing = min( spacing, ( _Pos[u].normalized() - q ).len() );
+      if ( ( _Rotations[i] * _Pos[v].normalized() - q ).len() > spacing / 2 )
+         return false;
+   }
+   return true;
+}
+
+bool SymmetryDetection::permutesColors() const
+{
+   for ( const Perm& colorPerm : _ColorPerms )
+      for ( int c : _Colors )
+         if ( colorPerm[c] != c )
+            return true;
+   return false;
+}
+
+void SymmetryDetection::classify()
+{
+   int n = order();
+   int maxOrder = 1;
+   for ( const Rotation3& m : _Rotations )
+   {
+      XYZ axis;
+      double angle;
+      axisAngleOf( m, axis, angle );
+      maxOrder = max( maxOrder, orderOf( angle, n ) );
+   }
+
+   if      ( n < 2 )            _Name = "";
+   else if ( maxOrder == n )    _Name = "rot" + to_string( n );
+   else if ( 2*maxOrder == n )  _Name = "dih" + to_string( maxOrder );
+   else if ( n == 12 )          _Name = "tetra12";
+   else if ( n == 24 )          _Name = "octa24";
+   else if ( n == 60 )          _Name = "ico60";
+   else                         _Name = "";
+}
+
+// looks for a rotation that conjugates the detected rotations into the elements of the named symmetry
+// - the first rotation generates the largest cyclic subgroup, the second one is any rotation about another axis
+bool SymmetryDetection::align( const vector<ISymmetry::Config>& configs )
+{
+   int n = order();
+   if ( (int) configs.size() != n )
+      return false;
+
+   vector<XYZ> axes( n ), symAxes( n );
+   vector<double> angles( n ), symAngles( n );
+   for ( int i = 0; i < n; i++ )
+   {
+      axisAngleOf( _Rotations[i], axes[i], angles[i] );
+      axisAngleOf( configs[i].m, symAxes[i], symAngles[i] );
+   }
+
+   int g1 = -1;
+   for ( int i = 1; i < n; i++ ) if ( g1 < 0 || angles[i] < angles[g1] )
+      g1 = i;
+   int g2 = -1;
+   for ( int i = 1; i < n; i++ ) if ( g2 < 0 && abs( axes[i] * axes[g1] ) < .99 )
+      g2 = i;
+   int s1 = -1;
+   for ( int i = 1; i < n; i++ ) if ( s1 < 0 && abs( symAngles[i] - angles[g1] ) < TOLERANCE )
+      s1 = i;
+   if ( g1 < 0 || s1 < 0 )
+      return false;
+
+   vector<Rotation3> candidates;
+   if ( g2 < 0 ) // cyclic
+   {
+      auto perpendicular = []( const XYZ& u ) { return u ^ ( abs( u.x ) < .9 ? XYZ(1,0,0) : XYZ(0,1,0) ); };
+      for ( double sign : { 1., -1. } )
+         candidates.push_back( frameOf( symAxes[s1], perpendicular( symAxes[s1] ) ) * frameOf( axes[g1] * sign, perpendicular( axes[g1] * sign ) ).inverted() );
+   }
+   else
+   {
+      for ( int s2 = 1; s2 < n; s2++ ) if ( abs( symAngles[s2] - angles[g2] ) < TOLERANCE )
+         for ( double sign1 : { 1., -1. } )
+            for ( double sign2 : { 1., -1. } )
+               if ( abs( ( axes[g1] * axes[g2] ) * sign1 * sign2 - symAxes[s1] * symAxes[s2] ) < TOLERANCE )
+                  candidates.push_back( frameOf( symAxes[s1], symAxes[s2] ) * frameOf( axes[g1] * sign1, axes[g2] * sign2 ).inverted() );
+   }
+
+   for ( const Rotation3& a : candidates )
+   {
+      Rotation3 aInv = a.inverted();
+      _Elems.assign( n, -1 );
+      vector<bool> isUsed( n, false );
+      bool ok = true;
+      for ( int i = 0; i < n && ok; i++ )
+      {
+         Rotation3 m = a * _Rotations[i] * aInv;
+         for ( int s = 0; s < n && _Elems[i] < 0; s++ )
+            if ( !isUsed[s] && maxDiff( m, configs[s].m ) < TOLERANCE )
+            {
+               _Elems[i] = s;
+               isUsed[s] = true;
+            }
+         ok = _Elems[i] >= 0;
+      }
+      if ( ok && alignColors( configs ) )
+      {
+         _Alignment = a;
+         return true;
+      }
+   }
+   return false;
+}
+
+// looks for a relabeling of the colors, so that color(rotation i * v) == configs[_Elems[i]].colorPerm[color(v)]
+bool SymmetryDetection::alignColors( const vector<ISymmetry::Config>& configs )
+{
+   vector<int> used;
+   for ( int c : _Colors )
+      if ( find( used.begin(), used.end(), c ) == used.end() )
+         used.push_back( c );
+   sort( used.begin(), used.end() );
+
+   // assigns colorMap[c] = target and everything that follows from it
+   auto propagate = [&]( vector<int>& colorMap, int c, int target ) {
+      vector<int> queue = { c };
+      colorMap[c] = target;
+      for ( int q = 0; q < (int) queue.size(); q++ )
+      {
+         int d = queue[q];
+         for ( int i = 0; i < order(); i++ )
+         {
+            int e = _ColorPerms[i][d];
+            int te = configs[_Elems[i]].colorPerm[colorMap[d]];
+            if ( ( e == BLANK_COLOR ) != ( te == BLANK_COLOR ) || te < 0 || te > BLANK_COLOR )
+               return false;
+            if ( colorMap[e] < 0 )
+            {
+               if ( find( colorMap.begin(), colorMap.end(), te ) != colorMap.end() )
+                  return false;
+               colorMap[e] = te;
+               queue.push_back( e );
+            }
+            else if ( colorMap[e] != te )
+               return false;
+         }
+      }
+      return true;
+   };
+
+   function<bool(int, const vector<int>&)> search = [&]( int idx, const vector<int>& colorMap ) {
+      if ( idx == (int) used.size() )
+      {
+         _ColorMap = Perm( colorMap );
+         return true;
+      }
+      int c = used[idx];
+      if ( colorMap[c] >= 0 )
+         return search( idx+1, colorMap );
+      for ( int target = 0; target <= BLANK_COLOR; target++ ) if ( find( colorMap.begin(), colorMap.end(), target ) == colorMap.end() )
+      {
+         vector<int> next = colorMap;
+         if ( propagate( next, c, target ) && search( idx+1, next ) )
+            return true;
+      }
+      return false;
+   };
+
+   if ( !search( 0, vector<int>( BLANK_COLOR+1, -1 ) ) )
+      return false;
+
+   // unused colors go to the unused colors in order
+   vector<int>& colorMap = _ColorMap.v;
+   int nextFree = 0;
+   for ( int& target : colorMap ) if ( target < 0 )
+   {
+      while ( find( colorMap.begin(), colorMap.end(), nextFree ) != colorMap.end() )
+         nextFree++;
+      target = nextFree++;
+   }
+   return true;
+}
+
+shared_ptr<Dual> SymmetryDetection::toDual()
+{
+   _Error.clear();
+   if ( _Name.empty() )
+   {
+      _Error = "no symmetry found";
+      return nullptr;
+   }
+   for ( int i = 1; i < order(); i++ ) if ( !mapsPositions( i ) )
+   {
+      _Error = "rotation " + to_string( i ) + " maps the tiling onto itself, but not the positions";
+      return nullptr;
+   }
+
+   if ( _Name != "ico60" && !GroupSymmetry::fromName( _Name ) )
+   {
+      _Error = _Name + " can't be represented, rot<n> and dih<n> only go up to n = " + to_string( GroupSymmetry::MAX_N );
+      return nullptr;
+   }
+
+   vector<ISymmetry::Config> configs = GlobalSymmetry::fromName( _Name )->matrices();
+   bool keepsColors = true;
+   for ( const ISymmetry::Config& config : configs )
+      for ( int c = 0; c <= BLANK_COLOR; c++ )
+         keepsColors &= config.colorPerm[c] == c;
+   if ( keepsColors && permutesColors() )
+   {
+      _Error = "the rotations permute the colors, but " + _Name + " keeps every color (only rot3, rot5, tetra12 and octa24 permute colors)";
+      return nullptr;
+   }
+   if ( !align( configs ) )
+   {
+      _Error = "the colors don't permute like " + _Name + " wants them to";
+      return nullptr;
+   }
+
+   GlobalSymmetry::setSymmetry( _Name );
+
+   // handle the rotations in the order of their elements, so that the first copy of an orbit that gets a VertexPtr is the real one
+   int n = order();
+   vector<int> rotations( n );
+   iota( rotations.begin(), rotations.end(), 0 );
+   sort( rotations.begin(), rotations.end(), [&]( int a, int b ) { return _Elems[a] < _Elems[b]; } );
+
+   shared_ptr<Dual> dual( new Dual );
+   vector<Dual::VertexPtr> ptrs( _Pos.size() );
+   vector<int> reps;
+   for ( int x = 0; x < (int) _Pos.size(); x++ ) if ( !ptrs[x].isValid() )
+   {
+      reps.push_back( x );
+
+      // average over the orbit, so that vertices on a rotation axis end up exactly on it
+      XYZ sum;
+      for ( int i = 0; i < n; i++ )
+         sum += MatrixIndexMap::at( MatrixIndexMap::inverse( _Elems[i] ) ) * ( _Alignment * _Pos[_Perms[i][x]] );
+      XYZ pos = sum.normalized() * _Pos[x].len();
+
+      int idx = (int) dual->_Vertices.size();
+      dual->addVertex( _ColorMap[_Colors[x]], pos );
+      dual->_Vertices.back()._SymmetryMap = MatrixSymmetryMap::symmetryFor( pos );
+      for ( int i : rotations )
+         if ( !ptrs[_Perms[i][x]].isValid() )
+            ptrs[_Perms[i][x]] = Dual::VertexPtr( idx, _Elems[i] );
+   }
+
+   // a vertex on a rotation axis only keeps one neighbor of every orbit under its stabilizer, the copies are implied
+   for ( Dual::Vertex& vtx : dual->_Vertices )
+   {
+      int x = reps[vtx._Index];
+      vector<int> stabilizer;
+      for ( int i = 0; i < n; i++ )
+         if ( _Perms[i][x] == x )
+            stabilizer.push_back( i );
+
+      vector<int> kept;
+      for ( int y : _Neighbors[x] )
+      {
+         bool isCopy = false;
+         for ( int i : stabilizer )
+            isCopy |= find( kept.begin(), kept.end(), _Perms[i][y] ) != kept.end();
+         if ( isCopy )
+            continue;
+         kept.push_back( y );
+         vtx._Neighbors.push_back( ptrs[y] );
+      }
+   }
+   dual->calcRings();
+   return dual;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "Model.h"
+
+// finds the rotations that map a dual (all its copies under the current symmetry) onto itself
+// - a rotation has to map vertices to vertices, edges to edges and every color to one color
+// - the rotations are found as orientation preserving automorphisms of the tiling, so positions that are only
+//   roughly symmetrical (relaxed under a smaller group) still count
+class SymmetryDetection
+{
+public:
+   SymmetryDetection( const Dual& dual );
+
+   int order() const { return (int) _Perms.size(); }
+   string name() const { return _Name; } // rot<n>, dih<n>, tetra12, octa24, ico60 or "" for no symmetry
+
+   // the dual expressed in the detected symmetry, with only one copy of every orbit
+   // - makes the detected symmetry current in this thread, the dual passed to the constructor keeps its own
+   // - nullptr with the reason in _Error if a rotation doesn't map the positions onto each other, or if the colors don't
+   //   permute like the named symmetry wants them to
+   // - only rot3, rot5, tetra12 and octa24 permute colors (a file only stores the name), dih<n> and the other rot<n> keep every
+   //   color, so a tiling whose rotations permute colors can't be converted to one of those
+   shared_ptr<Dual> toDual();
+
+private:
+   void findRotations();
+   bool findAutomorphism( int x0, int w, int offset, vector<int>& perm, Perm& colorPerm ) const;
+   Rotation3 rotationOf( const vector<int>& perm ) const;
+   bool mapsPositions( int i ) const;
+   bool permutesColors() const;
+   void classify();
+   bool align( const vector<ISymmetry::Config>& configs );
+   bool alignColors( const vector<ISymmetry::Config>& configs );
+
+public:
+   // the dual with all its copies
+   vector<XYZ> _Pos;
+   vector<int> _Colors;
+   vector<vector<int>> _Neighbors; // sorted around the vertex
+
+   // the rotations, element 0 is the identity
+   vector<vector<int>> _Perms;      // vertex v goes to _Perms[i][v]
+   vector<Perm> _ColorPerms;
+   vector<Rotation3> _Rotations;      // fitted to the positions
+   string _Name;
+
+   // filled by toDual
+   Rotation3 _Alignment;              // rotates the dual so that _Rotations become the elements of the named symmetry
+   vector<int> _Elems;              // index of the element that rotation i becomes
+   Perm _ColorMap;                  // relabels the colors so that they permute like the named symmetry wants
+   string _Error;                   // why toDual returned nullptr
+};
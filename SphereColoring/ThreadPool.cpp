@@ -0,0 +1,69 @@
+#include "ThreadPool.h"
+
+using namespace std;
+
+ThreadPool::ThreadPool( int numThreads )
+{
+   for ( int i = 1; i < numThreads; i++ )
+      _Threads.push_back( thread( [this, i]() { workerLoop( i ); } ) );
+}
+
+ThreadPool::~ThreadPool()
+{
+   {
+      lock_guard<mutex> lock( _Mutex );
+      _Quit = true;
+   }
+   _StartCondition.notify_all();
+   for ( thread& t : _Threads )
+      t.join();
+}
+
+void ThreadPool::run( const function<void(int)>& task )
+{
+   if ( _Threads.empty() )
+   {
+      task( 0 );
+      return;
+   }
+
+   {
+      lock_guard<mutex> lock( _Mutex );
+      _Task = &task;
+      _NumBusy = (int) _Threads.size();
+      _Generation++;
+   }
+   _StartCondition.notify_all();
+
+   task( 0 );
+
+   unique_lock<mutex> lock( _Mutex );
+   _DoneCondition.wait( lock, [this]() { return _NumBusy == 0; } );
+   _Task = nullptr;
+}
+
+void ThreadPool::workerLoop( int threadIdx )
+{
+   uint64_t generation = 0;
+   while ( true )
+   {
+      const function<void(int)>* task;
+      {
+         unique_lock<mutex> lock( _Mutex );
+         _StartCondition.wait( lock, [&]() { return _Quit || _Generation != generation; } );
+         if ( _Quit )
+            return;
+         generation = _Generation;
+         task = _Task;
+      }
+
+      (*task)( threadIdx );
+
+      {
+         lock_guard<mutex> lock( _Mutex );
+         if ( --_NumBusy > 0 )
+            continue;
+      }
+      _DoneCondition.notify_one();
+   }
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <cstdint>
+
+// fixed set of worker threads that all run the same task, used for data-parallel loops
+class ThreadPool
+{
+public:
+   ThreadPool( int numThreads );
+   ~ThreadPool();
+
+   int size() const { return (int) _Threads.size() + 1; }
+
+   // runs task( threadIdx ) for every threadIdx in [0,size()) and waits for all of them
+   // - the calling thread runs threadIdx 0
+   void run( const std::function<void(int)>& task );
+
+   // splits [0,n) into size() contiguous ranges
+   void rangeOf( int n, int threadIdx, int& begin, int& end ) const { begin = int( (int64_t) n * threadIdx / size() ); end = int( (int64_t) n * (threadIdx+1) / size() ); }
+
+private:
+   void workerLoop( int threadIdx );
+
+private:
+   std::vector<std::thread> _Threads;
+   std::mutex _Mutex;
+   std::condition_variable _StartCondition;
+   std::condition_variable _DoneCondition;
+   const std::function<void(int)>* _Task = nullptr;
+   uint64_t _Generation = 0;
+   int _NumBusy = 0;
+   bool _Quit = false;
+};
@@ -0,0 +1,225 @@
+#include "DualIO.h"
+#include "Simulation.h"
+#include "SymmetryDetection.h"
+#include <QCoreApplication>
+#include <QJsonDocument>
+#include <QJsonArray>
+#include <QJsonObject>
+#include <QFile>
+#include <QFileInfo>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QTextStream>
+#include <QStringList>
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+
+using namespace std;
+
+namespace
+{
+   struct Options
+   {
+      int maxSteps = 2000000;
+      int stepsPerCheck = 500; // same batch size as the GUI timer
+      double targetError = 0;
+      int stallChecks = 20;
+      bool useSimd = true;
+      bool useBroadPhase = true;
+      bool useActiveSet = true;
+      bool detectSymmetry = false;
+      bool resymmetrize = false;
+      Simulation::Solver solver = Simulation::GRADIENT_STEP;
+      int numThreads = 1;
+      int numJobs = 1;
+      QString outDir = ".";
+      vector<QString> files;
+   };
+
+   void printUsage()
+   {
+      QTextStream( stderr )
+         << "usage: SphereColoringBatch [options] file.dual...\n"
+         << "  -steps N    maximum number of simulation steps per file (default 2000000)\n"
+         << "  -check N    number of steps between error checks (default 500)\n"
+         << "  -target E   stop once the average error drops to E (default 0)\n"
+         << "  -stall N    stop once the error hasn't improved by 1% in N checks (default 20)\n"
+         << "  -out DIR    directory for the .relaxed output files (default .)\n"
+         << "  -nosimd     don't use the AVX2 kernels\n"
+         << "  -nobroadphase  evaluate every line-vertex constraint every step\n"
+         << "  -noactiveset   evaluate every keep-close/keep-far constraint every step\n"
+         << "  -solver S   gradient (default), lbfgs, lm (Levenberg-Marquardt) or pbd (position based)\n"
+         << "  -detect     report the largest symmetry of the tiling\n"
+         << "  -resymmetrize  relax in the largest symmetry of the tiling if it is larger than the saved one\n"
+         << "              (dih<n> and rot<n> other than rot3/rot5 only if the rotations keep every color)\n"
+         << "  -threads N  number of threads per simulation, 0 = one per core (default 1)\n"
+         << "  -jobs N     number of files relaxed at the same time, each in its own symmetry (default 1)\n";
+   }
+
+   bool parseSolver( const QString& name, Simulation::Solver& solver )
+   {
+      if      ( name == "gradient" ) solver = Simulation::GRADIENT_STEP;
+      else if ( name == "lbfgs" )    solver = Simulation::LBFGS;
+      else if ( name == "lm" )       solver = Simulation::LEVENBERG_MARQUARDT;
+      else if ( name == "pbd" )      solver = Simulation::POSITION_BASED;
+      else return false;
+      return true;
+   }
+
+   bool parseArgs( const QStringList& args, Options& opt )
+   {
+      for ( int i = 1; i < args.size(); i++ )
+      {
+         const QString& arg = args[i];
+         bool hasValue = i+1 < args.size();
+         bool ok = true;
+         if      ( arg == "-steps"  && hasValue ) opt.maxSteps      = args[++i].toInt( &ok );
+         else if ( arg == "-check"  && hasValue ) opt.stepsPerCheck = args[++i].toInt( &ok );
+         else if ( arg == "-target" && hasValue ) opt.targetError   = args[++i].toDouble( &ok );
+         else if ( arg == "-stall"  && hasValue ) opt.stallChecks   = args[++i].toInt( &ok );
+         else if ( arg == "-out"    && hasValue ) opt.outDir        = args[++i];
+         else if ( arg == "-threads" && hasValue ) opt.numThreads    = args[++i].toInt( &ok );
+         else if ( arg == "-jobs"   && hasValue ) opt.numJobs       = args[++i].toInt( &ok );
+         else if ( arg == "-nosimd" ) opt.useSimd = false;
+         else if ( arg == "-nobroadphase" ) opt.useBroadPhase = false;
+         else if ( arg == "-noactiveset" ) opt.useActiveSet = false;
+         else if ( arg == "-detect" ) opt.detectSymmetry = true;
+         else if ( arg == "-resymmetrize" ) opt.resymmetrize = true;
+         else if ( arg == "-solver" && hasValue ) ok = parseSolver( args[++i], opt.solver );
+         else if ( arg.startsWith( "-" ) ) return false;
+         else opt.files.push_back( arg );
+         if ( !ok )
+            return false;
+      }
+      return !opt.files.empty() && opt.stepsPerCheck > 0 && opt.numJobs > 0;
+   }
+
+   mutex s_printMutex; // lines of concurrent jobs must not interleave
+
+   void print( FILE* f, const QString& line )
+   {
+      lock_guard<mutex> lock( s_printMutex );
+      QTextStream( f ) << line;
+   }
+
+   void saveRelaxed( const QString& filename, const QString& source, const Simulation& sim, int steps, double totalError )
+   {
+      QJsonArray vertices;
+      for ( const Graph::Vertex& v : sim._Graph->_Vertices )
+         vertices.push_back( QJsonObject { { "x", v._Pos.x }, { "y", v._Pos.y }, { "z", v._Pos.z }, { "symmetrical", v._IsSymmetrical } } );
+
+      QJsonObject result = { { "source", source },
+                             { "symmetry", QString::fromStdString( sim._Graph->_Group->_Symmetry->name() ) },
+                             { "radius", sim._Radius },
+                             { "steps", steps },
+                             { "totalError", totalError },
+                             { "paddingError", sim._PaddingError },
+                             { "status", ConvergenceMonitor::nameOf( sim._Monitor.status() ) },
+                             { "vertices", vertices } };
+
+      QFile f( filename );
+      f.open( QFile::WriteOnly );
+      f.write( QJsonDocument( result ).toJson() );
+   }
+
+   // relaxes one file, returns false if it could not be loaded
+   bool relax( const QString& filename, const Options& opt )
+   {
+      shared_ptr<Dual> dual = loadDual( filename );
+      if ( !dual || dual->_Vertices.empty() )
+      {
+         print( stderr, "failed to load " + filename + "\n" );
+         return false;
+      }
+
+      QElapsedTimer timer;
+      timer.start();
+
+      if ( opt.detectSymmetry || opt.resymmetrize )
+      {
+         QString saved = QString::fromStdString( dual->_Group->_Symmetry->name() );
+         SymmetryDetection detection( *dual );
+         QString detected = detection.order() > 1 ? QString::fromStdString( detection.name() ) : "none";
+         if ( detected.isEmpty() )
+            detected = QString( "unknown order %1" ).arg( detection.order() );
+         print( stdout, QFileInfo( filename ).fileName() + " saved as " + saved + ", tiling has " + detected + "\n" );
+
+         if ( opt.resymmetrize && detection.order() > MatrixIndexMap::size() )
+         {
+            if ( shared_ptr<Dual> converted = detection.toDual() )
+            {
+               dual = converted;
+               saveDual( QDir( opt.outDir ).filePath( QFileInfo( filename ).completeBaseName() + "_" + detected + ".dual" ), *dual );
+            }
+            else
+               print( stdout, "  can't convert to " + detected + ": " + QString::fromStdString( detection._Error ) + ", staying with " + saved + "\n" );
+         }
+      }
+
+      double radius = dual->_Vertices[0]._Pos.len();
+      Simulation sim;
+      sim._UseSimd = opt.useSimd;
+      sim._UseBroadPhase = opt.useBroadPhase;
+      sim._UseActiveSet = opt.useActiveSet;
+      sim._Solver = opt.solver;
+      sim.setNumThreads( opt.numThreads > 0 ? opt.numThreads : (int) thread::hardware_concurrency() );
+      sim.init( dual, makeGraph( dual, radius, sim.buildThreadPool() ), radius );
+
+      sim._Monitor._Tolerance = opt.targetError;
+      sim._Monitor._StallWindows = opt.stallChecks;
+
+      int steps = 0;
+      double error = -1;
+      while ( steps < opt.maxSteps && !sim._Monitor.isFinished() )
+      {
+         int numSteps = min( opt.stepsPerCheck, opt.maxSteps - steps );
+         error = sim.step( numSteps );
+         steps += numSteps;
+      }
+
+      QString outFile = QDir( opt.outDir ).filePath( QFileInfo( filename ).completeBaseName() + ".relaxed" );
+      saveRelaxed( outFile, filename, sim, steps, error );
+
+      QString line;
+      QTextStream( &line ) << QFileInfo( filename ).fileName()
+                           << " steps=" << steps
+                           << " err=" << error
+                           << " pad=" << sim._PaddingError
+                           << " " << ConvergenceMonitor::nameOf( sim._Monitor.status() )
+                           << " ms=" << timer.elapsed() << "\n";
+      print( stdout, line );
+      return true;
+   }
+}
+
+int main( int argc, char *argv[] )
+{
+   QCoreApplication app( argc, argv );
+
+   Options opt;
+   if ( !parseArgs( app.arguments(), opt ) )
+   {
+      printUsage();
+      return 2;
+   }
+
+   // every job thread loads its files into its own symmetry context, so files of different symmetries can run side by side
+   atomic<int> nextFile( 0 );
+   atomic<int> numFailed( 0 );
+   auto job = [&]() {
+      for ( int i = nextFile++; i < (int) opt.files.size(); i = nextFile++ )
+         if ( !relax( opt.files[i], opt ) )
+            numFailed++;
+   };
+   vector<thread> jobs;
+   for ( int i = 1; i < min( opt.numJobs, (int) opt.files.size() ); i++ )
+      jobs.emplace_back( job );
+   job();
+   for ( thread& t : jobs )
+      t.join();
+
+   return numFailed ? 1 : 0;
+}